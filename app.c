@@ -37,11 +37,13 @@ test_msg_t;
 /*---------------------------------------------------------------------------*/
 static struct rp_conn conn; /* Connection structure */
 /*---------------------------------------------------------------------------*/
-/* Routing recv callback declarations */
+/* Routing recv and sent callback declarations */
 static void recv_cb(const linkaddr_t *originator, uint8_t hops);
+static void sent_cb(uint16_t handle, int status, uint8_t num_tx, clock_time_t latency);
 /*---------------------------------------------------------------------------*/
 struct rp_callbacks cb = {
-  .recv = recv_cb
+  .recv = recv_cb,
+  .sent = sent_cb
 };
 /*---------------------------------------------------------------------------*/
 PROCESS_THREAD(app_process, ev, data) 
@@ -106,7 +108,9 @@ PROCESS_THREAD(app_process, ev, data)
     packetbuf_set_datalen(sizeof(msg));
     printf("App: Send seqn %d to %02x:%02x\n",
       msg.seqn, dest.u8[0], dest.u8[1]);
-    rp_send(&conn, &dest);
+    int handle = rp_send(&conn, &dest);
+    if(handle <= 0)
+      printf("App: Send seqn %d failed (%d)\n", msg.seqn, handle);
     msg.seqn++;
   }
   PROCESS_END();
@@ -125,3 +129,10 @@ recv_cb(const linkaddr_t *originator, uint8_t hops)
     originator->u8[0], originator->u8[1], msg.seqn, hops);
 }
 /*---------------------------------------------------------------------------*/
+static void
+sent_cb(uint16_t handle, int status, uint8_t num_tx, clock_time_t latency)
+{
+  printf("App: First hop handle %u status %d tx %u latency %lu ms\n",
+    handle, status, num_tx, (unsigned long)latency * 1000 / CLOCK_SECOND);
+}
+/*---------------------------------------------------------------------------*/
@@ -0,0 +1,89 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+#ifndef DSC_TBL_H
+#define DSC_TBL_H
+
+#include "rp_types.h"
+#include <stdbool.h>
+
+/*---------------------------------------------------------------------------*/
+/* Descendant (downward route) store.
+   Descendants learned through topology reports are not radio neighbors, so they
+   are kept out of the NBR_TABLE: this is a compact open addressing hash table
+   (linear probing, backward shift deletion) mapping a 2-byte destination to the
+   2-byte child that is the next hop towards it. The size is fixed at build time,
+   see DSC_TBL_CONF_SIZE in project-conf.h.
+   In non-storing mode (RP_NON_STORING) only the sink uses it, mapping every node to its parent:
+   the router image has no table (DSC_TBL_SIZE 0), and the entries of the sink expire if the
+   periodic parent reports do not refresh them (dsc_tbl_age).
+   In storing mode the descendants reachable through the same child are chained (by address, so
+   the backward shifts do not break the chains), with one head per child: the subtree of a child
+   is removed in time proportional to its size, without scanning the table */
+/*---------------------------------------------------------------------------*/
+
+#define DSC_TBL_BY_VIA (!RP_NON_STORING)
+
+#if RP_NON_STORING && !RP_SINK_IMAGE
+#define DSC_TBL_SIZE 0
+#elif defined(DSC_TBL_CONF_SIZE)
+#define DSC_TBL_SIZE DSC_TBL_CONF_SIZE
+#else
+#define DSC_TBL_SIZE 64
+#endif
+
+/* the table is never filled above 3/4 to keep the probe sequences short */
+#define DSC_TBL_MAX_ENTRIES ((DSC_TBL_SIZE / 4) * 3)
+
+_Static_assert(((DSC_TBL_SIZE & (DSC_TBL_SIZE - 1)) == 0 && DSC_TBL_SIZE >= 4) || (RP_NON_STORING && DSC_TBL_SIZE == 0),
+               "DSC_TBL_SIZE must be a power of two");
+_Static_assert(LINKADDR_SIZE == 2, "the descendant table uses 2-byte keys");
+
+typedef struct{
+    linkaddr_t addr;    //descendant address (linkaddr_null marks an empty slot)
+    linkaddr_t nexthop; //child the descendant is reachable through
+#if DSC_TBL_BY_VIA
+    linkaddr_t sib;     //next descendant through the same child, linkaddr_null for the last one
+#else
+    uint8_t age;        //dsc_tbl_age() calls since the last dsc_tbl_add()
+#endif
+} dsc_entry_t;
+
+
+void dsc_tbl_init(void);
+
+/* removes every descendant */
+void dsc_tbl_flush(void);
+
+/* returns true and fills nexthop if there is a route to addr */
+bool dsc_tbl_lookup(const linkaddr_t* addr, linkaddr_t* nexthop);
+
+/* adds (or moves) a descendant. Returns false if the table is full */
+bool dsc_tbl_add(const linkaddr_t* addr, const linkaddr_t* nexthop);
+
+/* removes a descendant. Returns false if it was not in the table */
+bool dsc_tbl_remove(const linkaddr_t* addr);
+
+#if DSC_TBL_BY_VIA
+/* removes one of the descendants reachable through via and copies its address in addr.
+   Returns false if there is none left */
+bool dsc_tbl_pop_via(const linkaddr_t* via, linkaddr_t* addr);
+#endif
+
+#if !DSC_TBL_BY_VIA
+/* ages every entry by one step and removes the ones older than max_age steps */
+void dsc_tbl_age(uint8_t max_age);
+#endif
+
+/* access by slot index (0 ... DSC_TBL_SIZE-1), used to iterate the table.
+   Returns NULL for empty slots. Removing the entry at slot idx may move another
+   entry into the same slot, so the slot has to be checked again after a removal */
+const dsc_entry_t* dsc_tbl_get(uint16_t idx);
+
+/* number of descendants in the table */
+uint16_t dsc_tbl_count(void);
+
+#endif /* DSC_TBL_H */
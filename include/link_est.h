@@ -0,0 +1,81 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+#ifndef LINK_EST_H
+#define LINK_EST_H
+
+#include "rp_types.h"
+#include <stdbool.h>
+
+/*---------------------------------------------------------------------------*/
+/* Link estimator. The ETX of a link fuses three sources, weighted by how much
+   evidence each one has:
+   - prior: EWMA of the RSSI/LQI of the received beacons (weight LINK_EST_PRIOR_W)
+   - beacons: reception ratio over the last LINK_EST_BC_WINDOW beacon sequence
+     numbers, ETX = 1/BRR^2 assuming a symmetric link (weight: sequence numbers seen)
+   - unicast: tx attempts / ACKs over the last LINK_EST_UC_WINDOW frames
+     (weight: LINK_EST_UC_W per frame in the window)
+   The unicast window drops its oldest sample at every idle link_est_age(), so
+   an old estimate does not outlive the traffic that produced it */
+/*---------------------------------------------------------------------------*/
+
+#ifdef LINK_EST_CONF_UC_WINDOW
+#define LINK_EST_UC_WINDOW LINK_EST_CONF_UC_WINDOW
+#else
+#define LINK_EST_UC_WINDOW 8
+#endif
+
+/* 1 -> the LQI (when the radio reports it) is fused with the RSSI in the prior */
+#ifdef LINK_EST_CONF_USE_LQI
+#define LINK_EST_USE_LQI LINK_EST_CONF_USE_LQI
+#else
+#define LINK_EST_USE_LQI 1
+#endif
+
+#define LINK_EST_BC_WINDOW 16 //bits of the beacon reception bitmap
+#define LINK_EST_PRIOR_W   2
+#define LINK_EST_UC_W      4
+
+#define LQI_HIGH_REF 105
+#define LQI_LOW_THR  55
+
+#define LINK_EST_UC_ACKED   0x80 //unicast sample: the frame was acked
+#define LINK_EST_UC_TX_MASK 0x7F //unicast sample: MAC transmissions
+
+typedef struct{
+    etx_q88_t etx; //fused estimate
+    etx_q88_t prior; //RSSI/LQI estimate
+    uint16_t bc_map; //received beacons, bit 0 is the last sequence number
+    uint8_t bc_last; //last beacon sequence number
+    uint8_t bc_span; //sequence numbers covered by bc_map
+    uint8_t uc_win[LINK_EST_UC_WINDOW]; //unicast samples, ring buffer
+    uint8_t uc_head; //oldest sample
+    uint8_t uc_cnt; //samples in the window
+    bool uc_fresh; //a sample was added since the last link_est_age()
+} link_est_t;
+
+/* starts the estimate from the first beacon of a neighbor */
+void link_est_init(link_est_t* le, uint8_t bseq, int16_t rssi, uint8_t lqi);
+
+/* beacon with sequence number bseq received on the link */
+void link_est_beacon(link_est_t* le, uint8_t bseq, int16_t rssi, uint8_t lqi);
+
+/* outcome of a unicast frame: MAC transmissions and whether it was acked */
+void link_est_tx(link_est_t* le, uint8_t num_tx, bool acked);
+
+/* called periodically: drops the oldest unicast sample if no frame was sent since the last call */
+void link_est_age(link_est_t* le);
+
+static inline etx_q88_t link_est_etx(const link_est_t* le){
+  return le->etx;
+}
+
+/* true if link_est_age() still has unicast samples to drop */
+static inline bool link_est_uc_samples(const link_est_t* le){
+  return le->uc_cnt > 0;
+}
+
+#endif /* LINK_EST_H */
@@ -12,21 +12,71 @@
 #include "contiki.h"
 #include "rp_types.h"
 
+/* Metric arithmetic: 1 -> integer only (Q formats), 0 -> float (soft-float on the Sky).
+   Both variants share the same Q-format API and storage */
+#ifdef METRIC_CONF_FIXED_POINT
+#define METRIC_FIXED_POINT METRIC_CONF_FIXED_POINT
+#else
+#define METRIC_FIXED_POINT 1
+#endif
+
 #define RSSI_HIGH_REF (-35)
 #define RSSI_LOW_THR (-85)
-#define DELTA_ETX_MIN   0.30f 
+#define DELTA_ETX_MIN   0.30f
 #define THR_H       100.0f
 
-#if RDC_MODE == RDC_NULLRDC
-    #define ALPHA 0.9f //metric inertia
-#elif RDC_MODE == RDC_CONTIKIMAC
-    #define ALPHA 0.9f //metric inertia
-#endif
-
 /*-----METRIC DEFINITIONS-----*/
 #define METRIC_Q_FRAC_BITS  4
 #define METRIC_FP_SCALE     (1u << METRIC_Q_FRAC_BITS)   /* 16 -> Q12.4 */
 
+#define ETX_FP_SCALE        (1u << ETX_Q_FRAC_BITS)      /* 256 -> Q8.8 */
+#define ETX_Q88_MAX         ((etx_q88_t)0xFFFFu)
+
+/* Integer versions of the tuning constants above. They are folded at compile time,
+   no float arithmetic is left at runtime */
+/* improvement thresholds in Q12.12 (Q12.4 metric units with 8 more fractional bits) */
+#define THR_H_Q1212         ((uint32_t)(THR_H * METRIC_FP_SCALE * 256.0f * METRIC_FP_SCALE + 0.5f))
+#define DELTA_ETX_MIN_Q1212 ((uint32_t)(DELTA_ETX_MIN * METRIC_FP_SCALE * 256.0f + 0.5f))
+
+/* Congestion: every node advertises a congestion level, 0 ... CONG_LEVEL_MAX (saturated), from the
+   occupancy of its transmit queue (see rp.h). The path through a neighbor costs CONG_PENALTY (Q12.4)
+   more per level; 0 disables the penalty, the levels are still used for the backpressure */
+#define CONG_LEVEL_MAX 3
+#ifdef RP_CONF_CONG_PENALTY
+#define CONG_PENALTY RP_CONF_CONG_PENALTY
+#else
+#define CONG_PENALTY METRIC_FP_SCALE /* 1.0 per level */
+#endif
+
+/* Load balancing (optional): every node but the sink advertises its radio duty cycle and the size of
+   its subtree. The load index of a neighbor (0 ... 255) is the mean of the two, each scaled to its full
+   scale value (LOAD_DC_REF permille, LOAD_SUB_REF nodes), and the path through it costs
+   LOAD_WEIGHT * index / 256 (Q12.4) more: the busiest relays shed children to idler ones */
+#ifdef RP_CONF_LOAD_METRIC
+#define LOAD_METRIC RP_CONF_LOAD_METRIC
+#else
+#define LOAD_METRIC 0
+#endif
+#ifdef RP_CONF_LOAD_WEIGHT
+#define LOAD_WEIGHT RP_CONF_LOAD_WEIGHT
+#else
+#define LOAD_WEIGHT (2 * METRIC_FP_SCALE) /* 2.0 for a fully loaded relay */
+#endif
+#ifdef RP_CONF_LOAD_DC_REF
+#define LOAD_DC_REF RP_CONF_LOAD_DC_REF
+#else
+#define LOAD_DC_REF 50 /* 5% radio duty cycle */
+#endif
+#ifdef RP_CONF_LOAD_SUB_REF
+#define LOAD_SUB_REF RP_CONF_LOAD_SUB_REF
+#else
+#define LOAD_SUB_REF 16
+#endif
+
+/* integer and hundredths of a Q12.4 value, for printing */
+#define METRIC_Q124_INT(m)   ((unsigned)((m) >> METRIC_Q_FRAC_BITS))
+#define METRIC_Q124_FRAC(m)  ((unsigned)((((m) & (METRIC_FP_SCALE - 1)) * 100u) >> METRIC_Q_FRAC_BITS))
+
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
@@ -42,28 +92,71 @@ static inline float metric_q124_to_float(metric_q124_t q){
    return (float)q / METRIC_FP_SCALE;
  }
 /*---------------------------------------------------------------------------*/
-static inline float metric_improv_thr(float cur_metric) {
-  if(cur_metric <= 0.0f) return FLT_MAX; // deactivate improvement: something is wrong
-  float thr = THR_H / cur_metric;
+/* Q8.8 ETX -> Q12.4, rounded */
+static inline metric_q124_t etx_q88_to_q124(etx_q88_t etx){
+  return (metric_q124_t)(((uint32_t)etx + (1u << (ETX_Q_FRAC_BITS - METRIC_Q_FRAC_BITS - 1)))
+                          >> (ETX_Q_FRAC_BITS - METRIC_Q_FRAC_BITS));
+}
+/*---------------------------------------------------------------------------*/
+/* Minimum improvement (in Q12.12) for a new metric to be preferred over cur_metric */
+static inline uint32_t metric_improv_thr(metric_q124_t cur_metric) {
+  if(cur_metric == 0) return UINT32_MAX; // deactivate improvement: something is wrong
+  uint32_t thr = THR_H_Q1212 / cur_metric;
   /* dynamic thresholding: with larger metrics even small changes are privileged */
-  return (thr < DELTA_ETX_MIN) ? DELTA_ETX_MIN : thr;
+  return (thr < DELTA_ETX_MIN_Q1212) ? DELTA_ETX_MIN_Q1212 : thr;
 }
 /*---------------------------------------------------------------------------*/
-static inline bool preferred(float new_m, float cur_m){
-  float thr = metric_improv_thr(cur_m);
-  return (new_m + thr) < cur_m;
+static inline bool preferred(metric_q124_t new_m, metric_q124_t cur_m){
+#if METRIC_FIXED_POINT
+  if(new_m >= cur_m) return false;
+  uint32_t thr = metric_improv_thr(cur_m);
+  return ((uint32_t)(cur_m - new_m) << 8) > thr;
+#else
+  float cur_f = metric_q124_to_float(cur_m);
+  float thr = (cur_f <= 0.0f) ? FLT_MAX : THR_H / cur_f;
+  if(thr < DELTA_ETX_MIN) thr = DELTA_ETX_MIN;
+  return (metric_q124_to_float(new_m) + thr) < cur_f;
+#endif
 }
 /*---------------------------------------------------------------------------*/
-
-static inline float metric(float adv_metric, float etx){
-  return adv_metric + etx;
+/* path metric through a neighbor: advertised metric + link ETX (saturating) */
+static inline metric_q124_t metric(metric_q124_t adv_metric, etx_q88_t etx){
+#if METRIC_FIXED_POINT
+  if(adv_metric == METRIC_Q124_INF) return METRIC_Q124_INF;
+  uint32_t m = (uint32_t)adv_metric + etx_q88_to_q124(etx);
+  return (m >= METRIC_Q124_INF) ? METRIC_Q124_INF : (metric_q124_t)m;
+#else
+  if(adv_metric == METRIC_Q124_INF) return METRIC_Q124_INF;
+  return metric_float_to_q124(metric_q124_to_float(adv_metric) + (float)etx / ETX_FP_SCALE);
+#endif
+}
+/*---------------------------------------------------------------------------*/
+/* path metric m with the penalty for the congestion level of the next hop (saturating) */
+static inline metric_q124_t metric_cong(metric_q124_t m, uint8_t level){
+  if(m == METRIC_Q124_INF) return METRIC_Q124_INF;
+  uint32_t p = (uint32_t)m + (uint32_t)level * CONG_PENALTY;
+  return (p >= METRIC_Q124_INF) ? METRIC_Q124_INF : (metric_q124_t)p;
+}
+/*---------------------------------------------------------------------------*/
+/* load index of a node from its radio duty cycle (permille) and its subtree size */
+static inline uint8_t load_index(uint16_t dc_pm, uint16_t subtree){
+  uint32_t d = ((uint32_t)dc_pm << 8) / LOAD_DC_REF;
+  uint32_t s = ((uint32_t)subtree << 8) / LOAD_SUB_REF;
+  if(d > 0xFF) d = 0xFF;
+  if(s > 0xFF) s = 0xFF;
+  return (uint8_t)((d + s) >> 1);
+}
+/*---------------------------------------------------------------------------*/
+/* path metric m with the penalty for the load index of the next hop (saturating) */
+static inline metric_q124_t metric_load(metric_q124_t m, uint8_t load){
+  if(m == METRIC_Q124_INF) return METRIC_Q124_INF;
+  uint32_t p = (uint32_t)m + (((uint32_t)load * LOAD_WEIGHT + 0x80) >> 8);
+  return (p >= METRIC_Q124_INF) ? METRIC_Q124_INF : (metric_q124_t)p;
 }
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 
 
-float etx_est_rssi(uint16_t rssi); 
-
-
-float etx_update(uint16_t num_tx, uint16_t num_ack, float o_etx, uint16_t rssi);
+/* ETX estimate from the RSSI of a received frame (prior of the link estimator, see link_est.h) */
+etx_q88_t etx_est_rssi(int16_t rssi);
 #endif /* METRIC_UTILS_H */
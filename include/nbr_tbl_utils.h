@@ -9,35 +9,120 @@
 
 #include "rp_types.h"
 #include "metric.h"
+#include "dsc_tbl.h"
+#include "link_est.h"
 #include <stdbool.h>
 
 
 /*----Entry types----*/
 #define NODE_PARENT      0
 #define NODE_CHILD       1
-#define NODE_DESCENDANT  2
+#define NODE_DESCENDANT  2 //descendants are kept in the descendant table (dsc_tbl.h), not in the nbr table
 #define NODE_NEIGHBOR    3
 
+/*----Subtree summaries----*/
+/* Every node advertises in its beacons a Bloom filter (2 hash functions) over its descendants,
+   and keeps the filters of its neighbors: a packet that would go up to the parent is handed
+   sideways to a neighbor whose subtree may contain the destination. 0 disables the shortcuts.
+   By default the filter is sized from the descendant table: it stays at most half full (see
+   subtree_filter_build) up to about 3 descendants per byte, i.e. a full table on the Sky */
+#if RP_NON_STORING
+#define SUBTREE_FILTER_BYTES 0 //no subtree to summarize
+#elif defined(RP_CONF_SUBTREE_FILTER_BYTES)
+#define SUBTREE_FILTER_BYTES RP_CONF_SUBTREE_FILTER_BYTES
+#elif DSC_TBL_SIZE <= 32
+#define SUBTREE_FILTER_BYTES 8
+#elif DSC_TBL_SIZE <= 64
+#define SUBTREE_FILTER_BYTES 16
+#else
+#define SUBTREE_FILTER_BYTES 32
+#endif
+
+#if SUBTREE_FILTER_BYTES > 0
+_Static_assert((SUBTREE_FILTER_BYTES & (SUBTREE_FILTER_BYTES - 1)) == 0 && SUBTREE_FILTER_BYTES <= 32,
+               "SUBTREE_FILTER_BYTES must be a power of two, at most 32");
+#endif
+
+/*----Route errors----*/
+/* A node that cannot route a packet (the sink without a route, or a node that would send back up
+   a packet that came down from its parent) returns a route error to the source. The source keeps
+   the destination in a negative cache for RP_NEG_CACHE_TTL: rp_send() fails at once for it */
+#ifdef RP_CONF_NEG_CACHE_SIZE
+#define RP_NEG_CACHE_SIZE RP_CONF_NEG_CACHE_SIZE
+#else
+#define RP_NEG_CACHE_SIZE 4
+#endif
+#ifdef RP_CONF_NEG_CACHE_TTL
+#define RP_NEG_CACHE_TTL RP_CONF_NEG_CACHE_TTL
+#else
+#define RP_NEG_CACHE_TTL ((clock_time_t)(10 * CLOCK_SECOND))
+#endif
+
+/* Forwarding hints (storing mode): when a child moves to another parent its descendants are removed
+   and the ancestors are told, but for RP_FWD_HINT_TTL the packets for them are still handed to the
+   child (a neighbor, which knows the way down) instead of going up */
+#ifdef RP_CONF_FWD_HINT_SIZE
+#define RP_FWD_HINT_SIZE RP_CONF_FWD_HINT_SIZE
+#else
+#define RP_FWD_HINT_SIZE 8
+#endif
+#ifdef RP_CONF_FWD_HINT_TTL
+#define RP_FWD_HINT_TTL RP_CONF_FWD_HINT_TTL
+#else
+#define RP_FWD_HINT_TTL ((clock_time_t)(10 * CLOCK_SECOND))
+#endif
+
 typedef struct{
     uint8_t type;
     clock_time_t age;
     linkaddr_t nexthop;
     uint8_t hops;
-    float etx; //etx of the link
-    uint16_t num_tx;
-    uint16_t num_ack;
+    link_est_t le; //link quality estimate, link_est_etx() is the ETX of the link (Q8.8)
     metric_q124_t adv_metric; //advertised metric from this node
+    metric_q124_t cand_mt; //path metric through this node, key in the parent candidate heap
+    uint8_t cand_pos; //position in the parent candidate heap, PAR_CAND_NONE if not a candidate
+    uint8_t cong; //congestion level advertised in its last beacon
+#if LOAD_METRIC
+    uint8_t load; //load index from its last beacon (see metric.h)
+#endif
+#if !RP_NON_STORING
+    uint8_t rpt_seq; //report fragment expected from this child: report sequence number
+    uint8_t rpt_frag; //and fragment index
+    bool rpt_valid; //the expected label is in sync with the child
+    bool rpt_ack; //an ack is owed to the child
+#endif
+#if SUBTREE_FILTER_BYTES > 0
+    uint8_t dsc_filter[SUBTREE_FILTER_BYTES]; //advertised subtree summary (all zeros: none)
+#endif
 } entry_t;
 
 
-#define ENTRY_EXPIRATION_TIME (60 * CLOCK_SECOND)
+/* beacons of a node are at most 1.625 Trickle Imax apart (see beacon_timer_cb: no suppression at
+   Imax), 3.25 Imax with one of them lost: the expiry is 3.5 Imax. It is bounded by
+   ENTRY_EXPIRATION_MAX, so that a dead parent or child does not linger (checked in rp.h) */
+#define ENTRY_EXPIRATION_MAX ((clock_time_t)(60 * CLOCK_SECOND))
+#define ENTRY_EXPIRATION_TIME ((7 * (BEACON_TRICKLE_IMIN << BEACON_TRICKLE_IMAX)) / 2)
 
 #define VALID(age) ((clock_time() - (age)) < ENTRY_EXPIRATION_TIME)
 #define ALWAYS_VALID_AGE 0xFFFFFFFF
 #define ALWAYS_INVALID_AGE 0
 
 
-void nbr_tbl_lookup(nbr_table_t* nbr_tbl, linkaddr_t* nexthop, const linkaddr_t* dst_addr, const linkaddr_t* parent);
+/*next hop towards dst_addr: neighbor, descendant, forwarding hint, shortcut through a neighbor's subtree, or the parent.
+  prev_hop is the node the packet came from (never used as a shortcut)*/
+void nbr_tbl_lookup(nbr_table_t* nbr_tbl, linkaddr_t* nexthop, const linkaddr_t* dst_addr, const linkaddr_t* parent, const linkaddr_t* prev_hop);
+
+#if SUBTREE_FILTER_BYTES > 0
+/*builds the summary of this node's subtree. Returns false if there is nothing worth advertising
+  (no descendants, or the filter is too full to be useful)*/
+bool subtree_filter_build(nbr_table_t* nbr_tbl, uint8_t* filter);
+
+/*true if addr may be in the summarized subtree*/
+bool subtree_filter_test(const uint8_t* filter, const linkaddr_t* addr);
+#endif
+
+/*number of nodes in this node's subtree: the children and the known descendants*/
+uint16_t subtree_size(nbr_table_t* nbr_tbl);
 
 /*refresh entry in the neighbor table*/
 static inline void nbr_tbl_refresh(nbr_table_t* nbr_tbl, const linkaddr_t* addr){
@@ -47,11 +132,109 @@ static inline void nbr_tbl_refresh(nbr_table_t* nbr_tbl, const linkaddr_t* addr)
   }
 }
 
-void nbr_tbl_update(nbr_table_t* nbr_tbl,struct rp_conn* conn, const linkaddr_t* tx_addr, tpl_vec_t net_buf);
+#if !RP_NON_STORING
+/*book a topology change for the parent. The changes never sent (from conn->sent_off on) hold the
+  net change per node: a repeated change is dropped and opposite changes cancel out, since the
+  ancestors only learn the nodes they do not know and lose the ones they know.
+  Returns false if the buffer is full*/
+bool tpl_buf_put(struct rp_conn* conn, const linkaddr_t* addr, uint8_t status);
+
+void nbr_tbl_update(nbr_table_t* nbr_tbl,struct rp_conn* conn, const linkaddr_t* tx_addr, const tpl_vec_t* net_buf);
+
+/*remove only the descendants reachable through a child, and book their removal. With hint, the child
+  moved to another parent: packets for them are still handed to it for a while*/
+void remove_descendants(struct rp_conn* conn, linkaddr_t ch_addr, bool hint);
 
+void fwd_hint_add(const linkaddr_t* dst, const linkaddr_t* via);
+#endif
+
+/*destination reported unreachable by a route error*/
+void neg_cache_add(const linkaddr_t* addr);
+
+/*true if addr was reported unreachable less than RP_NEG_CACHE_TTL ago*/
+bool neg_cache_hit(const linkaddr_t* addr);
+
+/*remove an expired child (with its subtree, in storing mode)*/
 void remove_subtree(nbr_table_t* nbr_tbl,struct rp_conn* conn, linkaddr_t ch_addr);
 
-void nbr_tbl_cleanup_cb(void *ptr); 
+/*Expiry: the cleanup removes the expired entries and runs again at the earliest deadline (an entry
+  expiring, or the next aging of the unicast link samples, every NBR_TBL_CLEANUP_INTERVAL while
+  there are any). Refreshing an entry only moves its deadline later, so the timer is never late*/
+void nbr_tbl_cleanup_cb(void *ptr);
+
+/*make the cleanup run within the given time at the latest*/
+void nbr_tbl_cleanup_arm(struct rp_conn* conn, clock_time_t within);
+
+/*----Parent candidates----*/
+/* Neighbors that can become parent (NODE_NEIGHBOR with a finite advertised metric) are kept in a
+   binary min-heap ordered by the path metric through them. par_cand_update() has to be called
+   whenever the type, advertised metric, ETX or age of an entry change (O(log n)); removals go
+   through nbr_entry_remove(), evictions through par_cand_removed(), the nbr table callback */
+#define PAR_CAND_NONE 0xFF
+
+void par_cand_init(void);
+
+/*insert, move or remove the entry according to its current state*/
+void par_cand_update(entry_t* e);
+
+/*nbr table removal callback*/
+void par_cand_removed(void* item);
+
+/*best candidate (lowest path metric), NULL if there is none. O(1)*/
+entry_t* par_cand_best(void);
+
+/*path metric through a neighbor: advertised metric, link ETX, its congestion and load penalties*/
+static inline metric_q124_t path_metric(metric_q124_t adv_metric, etx_q88_t etx, uint8_t cong, uint8_t load){
+#if LOAD_METRIC
+  return metric_load(metric_cong(metric(adv_metric, etx), cong), load);
+#else
+  return metric_cong(metric(adv_metric, etx), cong);
+#endif
+}
+
+/*the same through the entry e, with its latest estimates (key of the candidate heap)*/
+static inline metric_q124_t nbr_path_metric(const entry_t* e){
+#if LOAD_METRIC
+  return path_metric(e->adv_metric, link_est_etx(&e->le), e->cong, e->load);
+#else
+  return path_metric(e->adv_metric, link_est_etx(&e->le), e->cong, 0);
+#endif
+}
+
+/*change the type of an entry, keeping the candidate heap consistent*/
+static inline void nbr_entry_set_type(nbr_table_t* nbr_tbl, entry_t* e, uint8_t type){
+  e->type = type;
+  par_cand_update(e);
+  //the parent and the children keep their key: the other tables sharing it (e.g. the MAC) cannot evict them
+  if(type == NODE_PARENT || type == NODE_CHILD)
+    nbr_table_lock(nbr_tbl, e);
+  else
+    nbr_table_unlock(nbr_tbl, e);
+}
+
+/*remove an entry from the nbr table (nbr_table_remove() does not call the removal callback)*/
+static inline void nbr_entry_remove(nbr_table_t* nbr_tbl, entry_t* e){
+  par_cand_removed(e);
+  nbr_table_remove(nbr_tbl, e);
+}
+
+/*----Admission----*/
+/* When the nbr table is full a new node only enters in place of a worse neighbor: stale entries
+   first, then the worst path metric (nbr_path_metric(): advertised metric + link ETX + congestion
+   and load penalties), then the least recently heard.
+   The parent, the children, the backup parent and the RP_NBR_PROTECTED best candidates are never
+   evicted for another neighbor. A node that advertises this node as its parent is a child: it is admitted in place of
+   any neighbor (the backup and the protected candidates included), and refused only when the table
+   holds nothing but the parent and the children. new_mt is its path metric (path_metric()) */
+#ifdef RP_CONF_NBR_PROTECTED
+#define RP_NBR_PROTECTED RP_CONF_NBR_PROTECTED
+#else
+#define RP_NBR_PROTECTED 3
+#endif
+
+/*new entry for addr, whose path metric is new_mt. NULL if it is not admitted (it is not
+  initialized)*/
+entry_t* nbr_tbl_admit(nbr_table_t* nbr_tbl, struct rp_conn* conn, const linkaddr_t* addr, metric_q124_t new_mt, bool child);
 
 
 #endif /* NBR_TBL_H_UT */
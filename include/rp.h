@@ -10,6 +10,8 @@
 #include "rp_types.h"
 #include "metric.h"
 #include "nbr_tbl_utils.h"
+#include "tpl_codec.h"
+#include "short_id.h"
 
 /*---------------------------------------------------------------------------*/
 
@@ -23,6 +25,21 @@ struct rp_callbacks {
    * uint8_t hops: number of hops from source to final destination
    */
   void (* recv)(const linkaddr_t *src, uint8_t hops);
+
+  /* The sent function (optional, may be NULL) is called once for every packet accepted by
+   * rp_send, when the first hop is over: the frame carrying it was acknowledged, or given up.
+   * It is never called from inside rp_send: the handle is always known to the caller first
+   * (a MAC result that comes before unicast_send() returns is handled from a timer). It may
+   * call rp_send itself.
+   *
+   * Arguments:
+   * uint16_t handle: the value returned by rp_send for the packet
+   * int status: MAC status of the last attempt (MAC_TX_OK if the next hop acknowledged it),
+   *             MAC_TX_ERR_FATAL if the frame could not be handed to the MAC
+   * uint8_t num_tx: MAC transmissions, over all the routing layer attempts
+   * clock_time_t latency: ticks from rp_send to the end of the first hop
+   */
+  void (* sent)(uint16_t handle, int status, uint8_t num_tx, clock_time_t latency);
 };
 
 
@@ -32,35 +49,173 @@ struct rp_callbacks {
 */
 #define MAX_PATH_LENGTH 40 //for the testbed we have 36 nodes
 
-#define TREE_BEACON_INTERVAL ((clock_time_t)(60.0f * (float)CLOCK_SECOND))
+/* Epoch mode: 1 -> keep the valid routing state across sink seqn bumps (incremental epochs),
+   0 -> rebuild the whole tree at every new seqn */
+#ifdef RP_CONF_INCREMENTAL_EPOCH
+#define RP_INCREMENTAL_EPOCH RP_CONF_INCREMENTAL_EPOCH
+#else
+#define RP_INCREMENTAL_EPOCH 1
+#endif
+
+/* The sink starts a new epoch (new beacon seqn) every TREE_EPOCH_INTERVAL. Between epochs
+   beacons are scheduled by a Trickle timer: the interval doubles from BEACON_TRICKLE_IMIN
+   up to BEACON_TRICKLE_IMIN * 2^BEACON_TRICKLE_IMAX while the routing state is consistent,
+   a beacon is suppressed if BEACON_TRICKLE_K consistent beacons were heard in the interval,
+   and the interval goes back to Imin on inconsistencies (new seqn, parent change, metric jump).
+   The maximum interval (16 s with both RDCs) is bounded by the neighbor expiry. A beacon is never
+   suppressed at the maximum interval, nor twice in a row: a node beacons at least every 1.625
+   maximum intervals, and its neighbors keep it for 3.5 (one lost beacon, see
+   ENTRY_EXPIRATION_TIME in nbr_tbl_utils.h) */
+#define TREE_EPOCH_INTERVAL ((clock_time_t)(300 * CLOCK_SECOND))
+
+#define BEACON_TRICKLE_K 2
+
+#define SUBTREE_REPORT_OFFSET ((clock_time_t)(20 * CLOCK_SECOND))
+
+#define NBR_TBL_CLEANUP_INTERVAL ((clock_time_t)(15 * CLOCK_SECOND)) /* aging period of the unicast link samples */
+
+/* Beacon solicitation. A node without a parent (at boot, or after losing its parent with no
+   candidate left) broadcasts a BC_SOLICIT frame (shorter than any beacon) at a random time in the
+   second half of an interval that doubles from RP_SOLICIT_IMIN up to RP_SOLICIT_IMAX, until it
+   has a parent. A connected neighbor answers by restarting its beacon trickle (the answers are
+   suppressed as any other beacon), at most once every RP_SOLICIT_HOLDOFF.
+   With RP_LOG_TREE, joins and losses of the parent are logged ("RP: Joined", "RP: Orphaned") also
+   without USR_DEBUG, see scripts/tree_formation.py */
+#ifdef RP_CONF_LOG_TREE
+#define RP_LOG_TREE RP_CONF_LOG_TREE
+#else
+#define RP_LOG_TREE 1
+#endif
+#define BC_SOLICIT     0xA5
+#define BC_SOLICIT_LEN 1
+#ifdef RP_CONF_SOLICIT_IMIN
+#define RP_SOLICIT_IMIN RP_CONF_SOLICIT_IMIN
+#else
+#define RP_SOLICIT_IMIN ((clock_time_t)(2 * CLOCK_SECOND))
+#endif
+#ifdef RP_CONF_SOLICIT_IMAX
+#define RP_SOLICIT_IMAX RP_CONF_SOLICIT_IMAX
+#else
+#define RP_SOLICIT_IMAX ((clock_time_t)(32 * CLOCK_SECOND))
+#endif
+#ifdef RP_CONF_SOLICIT_HOLDOFF
+#define RP_SOLICIT_HOLDOFF RP_CONF_SOLICIT_HOLDOFF
+#else
+#define RP_SOLICIT_HOLDOFF ((clock_time_t)(10 * CLOCK_SECOND))
+#endif
+
+/* Reliable topology reports. Every report fragment (standalone report or TLV_TPL) starts with
+   [report seqn][flags | fragment index]. A parent applies the fragments of a child in order and
+   acks the label of the next fragment it expects, in a TLV_RPT_ACK on a frame to the child or in a
+   UC_TYPE_RPT_ACK frame after RP_RPT_ACK_DELAY. The child keeps the changes until they are acked,
+   and resends the fragments from the first missing one after RP_RPT_TIMEOUT (doubled at every
+   timeout, up to 2^RP_RPT_BACKOFF_MAX times), on a duplicate ack, or at once when the data frame
+   carrying a TLV_TPL could not be queued or was not acked by the MAC.
+   RPT_SYNC marks the first fragment of a full report (the whole subtree, after a parent change),
+   accepted whatever the parent expected. In an ack it asks for one: the parent has no state for the child */
+#define RPT_HDR_LEN     2
+#define RPT_LAST        0x80 //last fragment of the report
+#define RPT_SYNC        0x40
+#define RPT_FRAG_MASK   0x3F
+#define RPT_KEY(seq, ff) ((uint16_t)(((uint16_t)(seq) << 8) | ((ff) & RPT_FRAG_MASK))) //position of a fragment
+#define RPT_BEFORE(a, b) ((int16_t)((uint16_t)(a) - (uint16_t)(b)) < 0) //with wrap around
+
+#ifdef RP_CONF_RPT_ACK_DELAY
+#define RP_RPT_ACK_DELAY RP_CONF_RPT_ACK_DELAY
+#else
+#define RP_RPT_ACK_DELAY ((clock_time_t)(CLOCK_SECOND))
+#endif
+#ifdef RP_CONF_RPT_TIMEOUT
+#define RP_RPT_TIMEOUT RP_CONF_RPT_TIMEOUT
+#else
+#define RP_RPT_TIMEOUT ((clock_time_t)(4 * CLOCK_SECOND))
+#endif
+#define RP_RPT_BACKOFF_MAX 3
+
+/* Wire format: 1 -> compressed unicast headers and beacons (1-byte node IDs, see short_id.h),
+   0 -> plain structs. All the nodes of a deployment have to be built with the same setting */
+#ifdef RP_CONF_HDR_COMPRESSION
+#define RP_HDR_COMPRESSION RP_CONF_HDR_COMPRESSION
+#else
+#define RP_HDR_COMPRESSION 1
+#endif
+
+/* Unicast transmit queue: frames waiting for the radio, and routing layer retries
+   of a frame after a collision or a MAC error */
+#ifdef RP_CONF_TX_QUEUE_SIZE
+#define RP_TX_QUEUE_SIZE RP_CONF_TX_QUEUE_SIZE
+#else
+#define RP_TX_QUEUE_SIZE 4
+#endif
+#define RP_TX_MAX_RETX 2
+/* a report burst stops at this queue length: the last slot is left to the data */
+#define RP_RPT_Q_MAX (RP_TX_QUEUE_SIZE > 1 ? RP_TX_QUEUE_SIZE - 1 : 1)
+
+/* Burst: a frame is sent with the frame pending bit when the next queued frame goes to the
+   same next hop, so that a ContikiMAC receiver stays awake for it (no new rendezvous) */
+#ifdef RP_CONF_BURST
+#define RP_BURST RP_CONF_BURST
+#else
+#define RP_BURST 1
+#endif
 
-#define SUBTREE_REPORT_OFFSET ((float)TREE_BEACON_INTERVAL / 3.0f)
+/* Frame aggregation: data frames to the same next hop that meet in the queue are packed in one
+   frame. A local packet that comes less than RP_AGG_WINDOW after the previous one (a burst of
+   the application) waits up to RP_AGG_WINDOW for more; forwarded and control frames never wait.
+   Default: on with ContikiMAC, where every frame costs a strobe train, off with NullRDC */
+#ifdef RP_CONF_AGG
+#define RP_AGG RP_CONF_AGG
+#elif RDC_MODE == RDC_CONTIKIMAC
+#define RP_AGG 1
+#else
+#define RP_AGG 0
+#endif
+#ifdef RP_CONF_AGG_WINDOW
+#define RP_AGG_WINDOW RP_CONF_AGG_WINDOW
+#else
+#define RP_AGG_WINDOW ((clock_time_t)(CLOCK_SECOND / 2))
+#endif
 
-#define NBR_TBL_CLEANUP_INTERVAL ((clock_time_t)(15.0f * (float)CLOCK_SECOND))
+/* Congestion backpressure: the occupancy of the transmit queue (in 1/256) is averaged (EWMA, 1/4)
+   at every enqueue, removal and beacon, a frame dropped on a full queue counting as full. The average
+   is quantized in CONG_LEVEL_MAX + 1 levels (see metric.h), with RP_CONG_HYST of hysteresis, and the
+   level is advertised in the beacons; entering or leaving saturation restarts the beacon trickle.
+   While the parent is saturated, rp_send() admits a packet for it only if fewer than RP_CONG_ADMIT
+   frames are queued (and returns 0 otherwise, as with a full queue) */
+#define RP_CONG_STEP (256 / (CONG_LEVEL_MAX + 1))
+#define RP_CONG_HYST 16
+#ifdef RP_CONF_CONG_ADMIT
+#define RP_CONG_ADMIT RP_CONF_CONG_ADMIT
+#else
+#define RP_CONG_ADMIT 1
+#endif
 
+/* All the timing constants use integer arithmetic only (no soft-float on the Sky) */
 
 /* -----constants for NullRDC-----*/
 #if RDC_MODE == RDC_NULLRDC
 
-    #define TREE_BEACON_FORWARD_DELAY ((clock_time_t)(((float)CLOCK_SECOND / 10.0f) + ((float)(random_rand() % (CLOCK_SECOND / 8)))))
+    #define BEACON_TRICKLE_IMIN ((clock_time_t)(CLOCK_SECOND / 2))
+    #define BEACON_TRICKLE_IMAX 5 /* doublings: 32 * Imin = 16 s */
 
-    #define SUBTREE_REPORT_BASE_DEL(hops) (((clock_time_t)(((float)(5*CLOCK_SECOND)) / (float)(hops))) + (float)(4*(random_rand() % CLOCK_SECOND/10)))
+    #define SUBTREE_REPORT_BASE_DEL(hops) ((clock_time_t)(((5 * CLOCK_SECOND) / (hops)) + (4 * ((random_rand() % CLOCK_SECOND) / 10))))
 
-    #define SUBTREE_REPORT_NODE_INTERVAL(hops) ((clock_time_t)(SUBTREE_REPORT_OFFSET * (1.0f + (1.0f / (float)(hops)))))
+    #define SUBTREE_REPORT_NODE_INTERVAL(hops) ((clock_time_t)(SUBTREE_REPORT_OFFSET + (SUBTREE_REPORT_OFFSET / (hops))))
 
-    #define SUBTREE_REPORT_DELAY ((clock_time_t)(((float)CLOCK_SECOND / 10.0f) + (float)(random_rand() % (CLOCK_SECOND / 10))))
+    #define SUBTREE_REPORT_DELAY ((clock_time_t)((CLOCK_SECOND / 10) + (random_rand() % (CLOCK_SECOND / 10))))
 
 
 /* -----constants for ContikiMAC-----*/
 #elif RDC_MODE == RDC_CONTIKIMAC
 
-    #define TREE_BEACON_FORWARD_DELAY ((clock_time_t)(((float)CLOCK_SECOND / 8.0f) + ((float)(8*(random_rand() % CHANNEL_CHECK_INTERVAL_TICKS)))))
+    #define BEACON_TRICKLE_IMIN ((clock_time_t)(CLOCK_SECOND))
+    #define BEACON_TRICKLE_IMAX 4 /* doublings: 16 * Imin = 16 s */
 
-    #define SUBTREE_REPORT_BASE_DEL(hops) (((clock_time_t)((float)5*CLOCK_SECOND) / (float)(hops) ) + (float)(4*(random_rand() % CHANNEL_CHECK_INTERVAL_TICKS)))\
+    #define SUBTREE_REPORT_BASE_DEL(hops) ((clock_time_t)(((5 * CLOCK_SECOND) / (hops)) + (4 * (random_rand() % CHANNEL_CHECK_INTERVAL_TICKS))))
 
-    #define SUBTREE_REPORT_NODE_INTERVAL(hops) ((clock_time_t)( SUBTREE_REPORT_OFFSET * (1.0f + (1.0f / (float)(hops))) ))
+    #define SUBTREE_REPORT_NODE_INTERVAL(hops) ((clock_time_t)(SUBTREE_REPORT_OFFSET + (SUBTREE_REPORT_OFFSET / (hops))))
 
-    #define SUBTREE_REPORT_DELAY ((clock_time_t)(((float)CLOCK_SECOND / 10.0f) + (float)(4*(random_rand() % CHANNEL_CHECK_INTERVAL_TICKS))))
+    #define SUBTREE_REPORT_DELAY ((clock_time_t)((CLOCK_SECOND / 10) + (4 * (random_rand() % CHANNEL_CHECK_INTERVAL_TICKS))))
 
 #endif
 
@@ -69,6 +224,48 @@ struct rp_callbacks {
 
 #define UC_TYPE_DATA 0
 #define UC_TYPE_REPORT 1
+#define UC_TYPE_AGG 2 //aggregate of data frames (never in a uc_hdr, see UC_AGG_HDR)
+#define UC_TYPE_EXT 3 //compressed header only: the type is in the extension byte
+#define UC_TYPE_RPT_ACK 4 //report ack from a parent to a child (compressed: in the extension byte)
+#define UC_TYPE_PAR_RPT 5 //non-storing: parent report, from a node up to the sink
+#define UC_TYPE_SR 6 //non-storing: data frame with a source route, from the sink down
+#define UC_TYPE_RERR 7 //route error, to the source of a packet that could not be routed
+
+/* reports and report acks go between a child and its parent: both addresses are implied by the link layer */
+#define UC_TYPE_HOP_LOCAL(t) ((t) == UC_TYPE_REPORT || (t) == UC_TYPE_RPT_ACK)
+/* frames to the sink: the destination is implied */
+#define UC_TYPE_TO_SINK(t) ((t) == UC_TYPE_PAR_RPT)
+
+/* Route errors. The sink without a route to the destination, or a node that got a packet from its
+   parent and could only send it back up (stale route), drops it and sends a UC_TYPE_RERR frame to
+   its source, routed as data. The payload is the unreachable destination (short_id_write). The
+   source puts it in the negative cache (nbr_tbl_utils.h). No route error is sent for a route error */
+
+/* Non-storing mode (RP_NON_STORING, see rp_types.h). A parent report carries the parent of its source
+   (short_id_write) and is refreshed every SUBTREE_REPORT_NODE_INTERVAL, the sink keeps them in the
+   descendant table (node -> parent). A packet for a node that is not a neighbor goes up to the sink,
+   which sends it down with the route [type | count][node IDs]: the hops after the first one,
+   destination excluded, at the start of the payload. Every hop pops its next hop, the last one sends
+   a frame of the carried type (data or route error).
+   Only the sink image (make NON_STORING=1 SINK=1, RP_SINK_IMAGE) has the parent map; the routers are
+   built without it. Every RP_PAR_MAP_SWEEP the sink ages the map and drops the nodes not refreshed for
+   more than RP_PAR_MAP_MAX_AGE sweeps (three report intervals at one hop): dead or gone */
+#ifdef RP_CONF_PAR_MAP_MAX_AGE
+#define RP_PAR_MAP_MAX_AGE RP_CONF_PAR_MAP_MAX_AGE
+#else
+#define RP_PAR_MAP_MAX_AGE 6
+#endif
+#define RP_PAR_MAP_SWEEP SUBTREE_REPORT_OFFSET
+#ifdef RP_CONF_SR_MAX_HOPS
+#define RP_SR_MAX_HOPS RP_CONF_SR_MAX_HOPS
+#else
+#define RP_SR_MAX_HOPS 12
+#endif
+#define SR_TYPE_SHIFT 5
+#define SR_CNT_MASK   0x1F
+#if RP_SR_MAX_HOPS > SR_CNT_MASK
+#error "RP_SR_MAX_HOPS does not fit in the source route count"
+#endif
 
 
 struct uc_hdr{
@@ -76,17 +273,73 @@ struct uc_hdr{
     linkaddr_t s_addr;
     linkaddr_t d_addr;
     uint8_t hops;
+    uint16_t rank; //routed frames: rank (metric) of the last sender and the flags below
 }__attribute__((packed));
 
+/* Loop detection. Every hop writes its rank (Q12.4 metric, saturated to UC_RANK_MASK) in the
+   header, with UC_RANK_DOWN unless the frame goes to its parent. A frame going up must come from
+   a node with a higher rank than the receiver: the first time it does not (the sender may only
+   have a stale view of the receiver) the frame goes on with UC_RANK_ERR set, the second time it
+   is dropped. Both cases restart the beacon trickle of the receiver, to refresh the neighbors */
+#define UC_RANK_DOWN 0x8000
+#define UC_RANK_ERR  0x4000
+#define UC_RANK_MASK 0x3FFF
+
+/* Compressed unicast header (RP_HDR_COMPRESSION):
+   byte 0: type (2 bits) | S (1 bit) | hops (5 bits)
+   then, for data frames, the destination and (unless S is set) the source as node IDs
+   (short_id_write), and the rank field (2 bytes, big endian). S: the source is the link layer
+   sender and is not sent. Hop local frames (UC_TYPE_HOP_LOCAL) carry no addresses and no rank */
+#define UC_HC_TYPE_SHIFT  6
+#define UC_HC_SRC_ELIDED  0x20
+#define UC_HC_HOPS_MASK   0x1F
+#define UC_HC_MAX_LEN     (1 + 2 * (1 + LINKADDR_SIZE) + 2)
+
+/* TLVs: optional [type][length][value] fields after the unicast header and after the beacon
+   fields. They are hop-by-hop (a forwarder does not copy them), unknown types are skipped.
+   A unicast header followed by TLVs has the UC_EXT_TLV flag and then [TLVs length][TLVs]: the flag
+   is in the type byte of struct uc_hdr, or, compressed, in an extension byte (type field
+   UC_TYPE_EXT, then real type | flags). Beacon TLVs run to the end of the frame */
+#define UC_EXT_TLV        0x80
+#define UC_EXT_TYPE_MASK  0x1F
+#define TLV_HDR_LEN       2
+#define TLV_TPL           1 //topology changes for the receiver (tpl_codec.h), piggybacked by a child
+#define TLV_SUBTREE_FILTER 2 //beacons: subtree summary (see nbr_tbl_utils.h)
+#define TLV_RPT_ACK       3 //report ack for the receiver, piggybacked by its parent
+#define TLV_CONGESTION    4 //beacons: congestion level of the sender (absent: 0)
+#define TLV_LOAD          5 //beacons: radio duty cycle (permille) and subtree size of the sender, 1 byte each (LOAD_METRIC)
+#define RP_TLV_MAX_LEN    48 //TLV bytes in a frame: a beacon fits the largest subtree filter, congestion and load
+#define UC_HDR_MAX_LEN    (UC_HC_MAX_LEN + 2 + RP_TLV_MAX_LEN)
+
+/* Aggregate frame: the UC_AGG_HDR byte, then records of [length (1 byte)][data frame
+   (unicast header and payload)]. Each record is processed as a frame from the same sender */
+#if RP_HDR_COMPRESSION
+#define UC_AGG_HDR (UC_TYPE_AGG << UC_HC_TYPE_SHIFT)
+#else
+#define UC_AGG_HDR UC_TYPE_AGG
+#endif
+#define RP_AGG_MAX_LEN (PACKETBUF_SIZE - PACKETBUF_HDR_SIZE)
+
+/* frames are dropped after RP_MAX_HOPS hops (the compressed header has 5 bits for the hops) */
+#if RP_HDR_COMPRESSION && MAX_PATH_LENGTH > UC_HC_HOPS_MASK
+#define RP_MAX_HOPS UC_HC_HOPS_MASK
+#else
+#define RP_MAX_HOPS MAX_PATH_LENGTH
+#endif
+
 
 /*-----BROADCAST MESSAGE DEFINITION-----*/
 struct bc_msg{
     uint16_t seqn;
     metric_q124_t metric_q124; //Q12.4 encoding to reduce float to 2 bytes
     uint8_t hops;
+    uint8_t bseq; //beacon sequence number, for the beacon reception ratio (link_est.h)
     linkaddr_t parent;
   }__attribute__((packed));
 
+/* Compressed beacon: same fields, the parent as a node ID (short_id_write) */
+#define BC_HC_FIXED_LEN   (sizeof(uint16_t) + sizeof(metric_q124_t) + 2 * sizeof(uint8_t))
+
 
 
 
@@ -101,11 +354,16 @@ struct bc_msg{
 #define PACKETBUF_HDR_SIZE 9 //manual fallback, works for zolertia firefly and tmote sky
 #endif
 
-#define RP_TPL_META_LEN      1                       /* size field      */
-#define RP_TPL_UC_HDR_LEN    6   /* unicast header byte length          */
+#define RP_TPL_META_LEN      1                       /* format/size field */
+#if RP_HDR_COMPRESSION
+#define RP_TPL_UC_HDR_LEN    1   /* compressed report header: addresses implied */
+#else
+#define RP_TPL_UC_HDR_LEN    8   /* unicast header byte length          */
+#endif
 
-#define RP_TPL_MAX_BYTES (PACKETBUF_SIZE - PACKETBUF_HDR_SIZE - RP_TPL_UC_HDR_LEN - RP_TPL_META_LEN)
+#define RP_TPL_MAX_BYTES (PACKETBUF_SIZE - PACKETBUF_HDR_SIZE - RP_TPL_UC_HDR_LEN - RPT_HDR_LEN - RP_TPL_META_LEN)
 
+/* worst case: entries without a short node ID cost 3 bytes, in either encoding (see tpl_codec.h) */
 #define RP_MAX_STAT_PER_FRAG (RP_TPL_MAX_BYTES / 3) /*3: sizeof/(stat_addr_t)*/
 
 #if RP_MAX_STAT_PER_FRAG < 1
@@ -133,14 +391,27 @@ void rp_open(
  * const linkaddr_t *dest: the final link layer destination address to send the
  *                         the message to.
  * Return value:
- * Non-zero if the packet could be sent, zero otherwise
+ * Positive if the packet was queued for transmission: the handle of the packet, passed
+ * to the sent callback when the first hop is over. Zero if the transmit queue
+ * is full, negative if there is no route (-1: the node is not connected, the sink has no
+ * route, or a route error for the destination was received less than RP_NEG_CACHE_TTL ago)
+ * or the header does not fit (-2)
  */
 int rp_send(struct rp_conn *c, const linkaddr_t *dest);
 /*---------------------------------------------------------------------------*/
+/* Number of frames in the transmit queue (the one in flight included) */
+uint8_t rp_tx_queue_len(const struct rp_conn *c);
+/*---------------------------------------------------------------------------*/
 extern void subtree_report_cb(void* ptr);
 
 void change_parent(void *ptr);
 
+_Static_assert(3 * TLV_HDR_LEN + SUBTREE_FILTER_BYTES + 1 + 2 <= RP_TLV_MAX_LEN,
+               "beacon TLVs (subtree filter, congestion, load) do not fit in RP_TLV_MAX_LEN");
+
+_Static_assert(ENTRY_EXPIRATION_TIME <= ENTRY_EXPIRATION_MAX,
+               "BEACON_TRICKLE_IMAX too large: neighbors would expire after more than ENTRY_EXPIRATION_MAX");
+
 _Static_assert((MAX_PATH_LENGTH * 10) <= ((1 << 12) - 1),
                "Q12.4 overflow: increase integer bits or reduce MAX_PATH_LENGTH");
 
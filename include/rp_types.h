@@ -18,6 +18,8 @@
 #include "net/rime/rime.h"
 #include "lib/list.h"
 #include "lib/memb.h"
+#include "lib/trickle-timer.h"
+#include "net/queuebuf.h"
 #include <stdio.h> /* For printf */
 
 typedef uint16_t metric_q124_t;      /* Q12.4: 12-bit int, 4-bit frac */
@@ -26,6 +28,28 @@ typedef uint16_t metric_q124_t;      /* Q12.4: 12-bit int, 4-bit frac */
 
 #define METRIC_Q124_INF  ((metric_q124_t)0xFFFFu)   /* 4095.9375 approx */
 
+typedef uint16_t etx_q88_t;          /* Q8.8: link ETX, finer resolution for the EWMA */
+#define ETX_Q_FRAC_BITS      8
+
+
+/* Downward routing mode. 0 -> storing: every node keeps the routes to its subtree, learned with
+   the topology reports. 1 -> non-storing: only the sink keeps the parent of every node, learned with
+   the parent reports, and sends the packets down with a source route; the other nodes keep only
+   their neighbors. All the nodes of a deployment have to be built with the same setting */
+#ifdef RP_CONF_NON_STORING
+#define RP_NON_STORING RP_CONF_NON_STORING
+#else
+#define RP_NON_STORING 0
+#endif
+
+/* Non-storing mode: 1 -> sink image, with the parent map (make NON_STORING=1 SINK=1). The router
+   image has no descendant table and cannot be opened as sink */
+#ifdef RP_CONF_SINK_IMAGE
+#define RP_SINK_IMAGE RP_CONF_SINK_IMAGE
+#else
+#define RP_SINK_IMAGE 0
+#endif
+
 
 /*----Struct for collecting the routing table changes (to send in topology reports)----*/
 #define STATUS_ADD 1
@@ -36,12 +60,68 @@ typedef struct __attribute__((packed)){
     uint8_t status;
 } stat_addr_t;
 
+//capacity of a topology vector: the entries of one report frame
+#define TPL_VEC_CAP NBR_TABLE_CONF_MAX_NEIGHBORS
+
 //vector of addresses to be added/removed
 typedef struct __attribute__((packed)){
     uint8_t size;
-    stat_addr_t stat_addr_arr[NBR_TABLE_CONF_MAX_NEIGHBORS]; 
+    stat_addr_t stat_addr_arr[TPL_VEC_CAP]; 
 } tpl_vec_t;
 
+/* capacity of the pending topology changes of a node (see tpl_buf_put): one entry per node
+   of its subtree, independently of the neighbor table */
+#ifdef RP_CONF_TPL_BUF_SIZE
+#define TPL_BUF_CAP RP_CONF_TPL_BUF_SIZE
+#else
+#define TPL_BUF_CAP 80
+#endif
+
+//pending topology changes, sent to the parent in one or more reports
+typedef struct __attribute__((packed)){
+    uint16_t size;
+    stat_addr_t stat_addr_arr[TPL_BUF_CAP];
+} tpl_buf_t;
+
+/*----Report fragment sent to the parent and not acknowledged yet (see rp.h)----*/
+#ifdef RP_CONF_RPT_WINDOW
+#define RP_RPT_WINDOW RP_CONF_RPT_WINDOW
+#else
+#define RP_RPT_WINDOW 4 //fragments in flight
+#endif
+
+typedef struct{
+    uint8_t seq; //report sequence number
+    uint8_t ff; //flags and fragment index
+    uint16_t end; //the fragment carries the changes of tpl_buf up to this offset, from the end of the previous one
+} rpt_frag_t;
+
+
+/*----Handles of the application packets (rp_send, see rp.h)----*/
+#define RP_HANDLE_MAX 0x7FFF //handles go 1 ... RP_HANDLE_MAX: positive also as a 16-bit int
+#ifdef RP_CONF_TX_HANDLES
+#define RP_TX_HANDLES RP_CONF_TX_HANDLES
+#else
+#define RP_TX_HANDLES 4 //application packets in one queued frame (aggregation: 1 is enough without it)
+#endif
+
+/*----Transmit queue item: one queued unicast frame with its own metadata----*/
+struct rp_tx_item {
+    struct rp_tx_item* next; //for the list
+    struct queuebuf* qb; //copy of the frame (header included)
+    linkaddr_t nexthop; //link layer destination of this frame
+    uint8_t type; //UC_TYPE_* of the frame
+    uint8_t retx; //routing layer retransmissions done so far
+    bool burst; //announced as pending by the previous frame: sent without waiting
+    bool hold; //local packet of a burst of the application: waits for the aggregation window
+    bool tpl; //carries a report fragment (TLV_TPL): resent as a standalone report if the frame is lost
+    clock_time_t enq_time; //enqueue timestamp
+    uint8_t num_tx; //MAC transmissions so far (all the attempts)
+    uint8_t n_handles; //packets of the application in the frame
+    uint16_t handle[RP_TX_HANDLES]; //their rp_send handles
+    clock_time_t handle_time[RP_TX_HANDLES]; //and their rp_send timestamps
+};
+
 
 //args struct for the cleanup callback
 typedef struct{
@@ -58,17 +138,51 @@ struct rp_conn {
     uint16_t seqn;
     const struct rp_callbacks* callbacks;
     linkaddr_t parent; //parent node
-    struct ctimer beacon_timer; //timer for sending beacons
+    linkaddr_t backup; //backup parent: closer to the sink than this node, linkaddr_null if none
+    struct trickle_timer beacon_tt; //trickle timer for sending beacons
+    bool bc_suppressed; //the last beacon was suppressed (never suppress two in a row)
+    uint8_t bseq; //sequence number of the last beacon sent
+    struct ctimer epoch_timer; //timer for the new epochs (sink only)
     struct ctimer nbr_tbl_cleanup_timer; //timer for routing table cleanup
+    struct ctimer solicit_timer; //next beacon solicitation (no parent)
+    clock_time_t solicit_int; //current solicitation interval
+    clock_time_t solicit_answered; //last time this node answered a solicitation
+    bool orphan; //no parent since boot or since the parent was lost (not during an epoch reset)
     cb_args_t clu_args;
 
     metric_q124_t metric; //metric to the sink
     uint8_t hops; //number of hops to the sink
 
     bool sink; //true if the node is the sink
-    tpl_vec_t tpl_buf; //vector of topology changes
-    uint8_t buf_off; //offset for the buffer, used when the buffer has to be fragmented in multiple packets
-    linkaddr_t last_uc_daddr; //last unicast destination address. Used to refresh in case of ack and to trigger parent change;
+#if !RP_NON_STORING
+    tpl_buf_t tpl_buf; //pending topology changes
+    uint16_t buf_off; //next change to send: the ones before it are in the fragments in flight
+    uint16_t sent_off; //the changes before this offset went on air at least once (no more coalescing)
+    rpt_frag_t rpt_win[RP_RPT_WINDOW]; //fragments in flight, oldest first
+    uint8_t rpt_cnt; //number of fragments in flight
+    uint8_t rpt_seq; //label of the next new fragment: report sequence number
+    uint8_t rpt_frag; //and fragment index
+    bool rpt_sync; //the next new fragment starts a full report
+    uint8_t rpt_retx; //consecutive ack timeouts (backoff exponent)
+    bool rpt_q_wait; //a report burst waits for a transmit queue slot (restarted by tx_q_pop)
+    struct ctimer rpt_timer; //ack timeout of the fragments in flight
+    struct ctimer rpt_ack_timer; //acks owed to the children
+#endif
+    LIST_STRUCT(tx_q); //unicast transmit queue (items from a memb pool), the head is the frame in flight
+    uint8_t tx_q_len; //number of queued frames
+    bool tx_busy; //true while the head of the queue is being transmitted
+    bool tx_in_send; //inside unicast_send(): a MAC result now is handled later (tx_late)
+    bool tx_late; //a MAC result waits for tx_late_timer
+    int tx_late_status; //its status
+    uint8_t tx_late_num_tx; //and transmissions
+    struct ctimer tx_late_timer;
+    uint16_t q_load; //average occupancy of the transmit queue, in 1/256
+    uint8_t cong; //congestion level, advertised in the beacons
+    uint16_t last_handle; //last rp_send handle given out
+    uint16_t tx_handle; //handle of the packet rp_send is queuing, 0 for the routing layer frames
+    bool tx_tpl; //the frame being queued carries a report fragment
+    clock_time_t app_last; //when rp_send queued the last packet
+    struct ctimer agg_timer; //end of the aggregation window of the head of the queue
   };
 
 
@@ -0,0 +1,34 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+#ifndef SHORT_ID_H
+#define SHORT_ID_H
+
+#include "rp_types.h"
+#include <stdbool.h>
+
+/*---------------------------------------------------------------------------*/
+/* 1-byte node IDs used by the compressed wire formats: the deployment table
+   on the testbed, the low address byte in Cooja. SHORT_ID_NONE is never a
+   valid ID: on the wire it means that the full 2-byte address follows */
+/*---------------------------------------------------------------------------*/
+
+#define SHORT_ID_NONE 0x00
+
+/* returns false if the address has no short ID */
+bool short_id_from_addr(const linkaddr_t* addr, uint8_t* id);
+
+/* returns false if the ID is unknown */
+bool short_id_to_addr(uint8_t id, linkaddr_t* addr);
+
+/* writes the ID of addr, or SHORT_ID_NONE and the full address. Returns the bytes written (1 or 3) */
+uint8_t short_id_write(uint8_t* buf, const linkaddr_t* addr);
+
+/* reads an address written by short_id_write from at most len bytes.
+   Returns the bytes read, 0 if the field is truncated or the ID is unknown */
+uint8_t short_id_read(const uint8_t* buf, uint16_t len, linkaddr_t* addr);
+
+#endif /* SHORT_ID_H */
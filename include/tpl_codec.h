@@ -0,0 +1,46 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+#ifndef TPL_CODEC_H
+#define TPL_CODEC_H
+
+#include "rp_types.h"
+#include <stdbool.h>
+
+/*---------------------------------------------------------------------------*/
+/* Topology report encoding.
+   Addresses are mapped to 1-byte node IDs (see short_id.h), and the first byte
+   of the payload selects the format:
+
+   00cccccc  legacy: c entries of stat_addr_t (3 bytes each)
+   01cccccc  id list: c status bits (1 = ADD, LSB first, padded to bytes), then c node IDs.
+             An address without an ID is sent as SHORT_ID_NONE followed by the 2-byte address
+   10rnnnnn  bitmap: base ID, then n bytes of ADD membership bitmap (bit i -> ID base+i)
+             and, if r is set, n more bytes of REMOVE bitmap. Used for dense subtrees
+   11xxxxxx  reserved
+
+   The encoder picks, for every fragment, the format that carries more entries
+   (fewer bytes on a tie). The decoder accepts all of them */
+/*---------------------------------------------------------------------------*/
+
+#define TPL_FMT_MASK      0xC0
+#define TPL_FMT_LEGACY    0x00
+#define TPL_FMT_IDLIST    0x40
+#define TPL_FMT_BITMAP    0x80
+#define TPL_FMT_BM_REMOVE 0x20 //bitmap only: REMOVE bitmap present
+#define TPL_CNT_MASK      0x3F //legacy and id list entry count
+#define TPL_BM_LEN_MASK   0x1F //bitmap length in bytes
+
+/* Encodes up to n entries of arr into buf (at most max_len bytes, at most TPL_VEC_CAP entries
+   so that the receiver can decode the frame). Returns the number of bytes written,
+   n_enc is set to the number of entries consumed */
+uint8_t tpl_encode(const stat_addr_t* arr, uint16_t n, uint8_t* buf, uint8_t max_len, uint8_t* n_enc);
+
+/* Decodes a report payload into out. Returns false if the payload is malformed
+   or does not fit in a topology vector */
+bool tpl_decode(const uint8_t* buf, uint16_t len, tpl_vec_t* out);
+
+#endif /* TPL_CODEC_H */
@@ -3,6 +3,25 @@
 #define PROJECT_CONF_H_
 /*---------------------------------------------------------------------------*/
 #define NBR_TABLE_CONF_MAX_NEIGHBORS 32
+/* Descendant table slots (power of two, filled up to 3/4): 6 bytes per slot (none in the routers
+   of the non-storing mode, only the sink image has it) */
+#if CONTIKI_TARGET_ZOUL
+#define DSC_TBL_CONF_SIZE           512
+#else
+#define DSC_TBL_CONF_SIZE            64
+#endif
+/* Pending topology changes: children plus descendants (3 bytes each) */
+#if CONTIKI_TARGET_ZOUL
+#define RP_CONF_TPL_BUF_SIZE       416
+#else
+#define RP_CONF_TPL_BUF_SIZE        80
+#endif
+/* Routing layer unicast transmit queue (frames are stored in queuebufs) */
+#if CONTIKI_TARGET_ZOUL
+#define RP_CONF_TX_QUEUE_SIZE        8
+#else
+#define RP_CONF_TX_QUEUE_SIZE        4
+#endif
 #define ENERGEST_CONF_ON              1
 /* Disable button shutdown functionality */
 #define BUTTON_SENSOR_CONF_ENABLE_SHUTDOWN    0
@@ -32,6 +51,23 @@
     #define CHANNEL_CHECK_INTERVAL_TICKS ((CLOCK_SECOND / NETSTACK_RDC_CHANNEL_CHECK_RATE) + ((CLOCK_SECOND/200))) //add 5ms to the check interval
 #endif
 
+/*-------------------------------METRIC-----------------------------------*/
+/* 1: integer-only (Q-format) link estimation and metric, 0: float arithmetic */
+#define METRIC_CONF_FIXED_POINT 1
+
+/*-------------------------------ROUTING----------------------------------*/
+/* 1: keep the valid routing state across epochs, 0: rebuild the tree at every epoch */
+#define RP_CONF_INCREMENTAL_EPOCH 1
+/* 1: compressed unicast headers and beacons (1-byte node IDs), 0: plain structs on the air */
+#define RP_CONF_HDR_COMPRESSION 1
+/* Bytes of the subtree summary (Bloom filter) sent in beacons for cross-branch shortcuts, 0: no shortcuts.
+   Default: sized from DSC_TBL_CONF_SIZE (16 bytes on the Sky, 32 on the Firefly) */
+//#define RP_CONF_SUBTREE_FILTER_BYTES 16
+/* Data frames to the same next hop are packed in one frame if sent within this window (on by default with ContikiMAC, see RP_CONF_AGG) */
+#define RP_CONF_AGG_WINDOW (CLOCK_SECOND / 2)
+/* 1: the parent choice also weighs the duty cycle and subtree size advertised by the neighbors (see metric.h) */
+#define RP_CONF_LOAD_METRIC 0
+
 /*-------------------------------DEBUG------------------------------------*/
 #define USR_DEBUG 0
 
@@ -0,0 +1,122 @@
+import os
+import re
+import shutil
+import subprocess
+import time
+
+# Compares the storing and the non-storing (source routed) downward modes on the same scenario:
+# RAM of the firmware, PDR, latency and duty cycle, averaged over NUM_RUNS runs per mode.
+# Run it from the project directory (where the simulation file is)
+
+# Number of simulation runs per mode
+NUM_RUNS = 10
+
+# Paths for the simulation file and the report file
+simulation_file = "test_nogui_dc.csc"
+safe_simulation_name = os.path.splitext(simulation_file.replace("/", "_"))[0]
+report_file = "mode_benchmark_{}.txt".format(safe_simulation_name)
+
+# Log file generated by the simulation
+log_file = "test.log"
+
+# Build modes: value of the NON_STORING make variable. The simulation has one mote type, so in
+# non-storing mode every mote runs the sink image (SINK=1); the RAM is reported for both images
+MODES = [("storing", "0"), ("non-storing", "1")]
+
+# Result lines printed by analysis.py
+PATTERNS = {
+    "pdr": re.compile(r"Overall PDR: ([0-9.]+)%"),
+    "latency": re.compile(r"Average: ([0-9.]+) ms"),
+    "dc": re.compile(r"Overall Duty Cycle: ([0-9.]+)%"),
+}
+
+
+def firmware_ram(env):
+    # data + bss of the Sky firmware (the one used by the simulation), None if msp430-size is missing
+    subprocess.call(["make", "TARGET=sky", "clean"], env=env)
+    subprocess.call(["make", "app.sky", "TARGET=sky"], env=env)
+    if shutil.which("msp430-size") is None:
+        return None
+    out = subprocess.check_output(["msp430-size", "app.sky"], universal_newlines=True)
+    fields = out.splitlines()[1].split()
+    return int(fields[1]) + int(fields[2])
+
+
+def run_once(env):
+    # run the simulation and return the analysis output
+    if os.path.exists(log_file):
+        os.remove(log_file)
+    sim_process = subprocess.Popen(
+        ["cooja_nogui", simulation_file],
+        stdout=subprocess.PIPE,
+        stderr=subprocess.STDOUT,
+        universal_newlines=True,
+        env=env
+    )
+    for line in iter(sim_process.stdout.readline, ""):
+        print(line.strip())
+    sim_process.wait()
+
+    # Check the simulation return code; accept 0 and 1 (1 if log is produced)
+    if sim_process.returncode not in [0, 1]:
+        raise Exception(f"Error running cooja_nogui (exit code {sim_process.returncode})")
+
+    # Wait until the log file is created and has content
+    max_wait_time = 300  # Maximum wait time in seconds
+    wait_time = 0
+    while not os.path.exists(log_file) or os.stat(log_file).st_size == 0:
+        if wait_time > max_wait_time:
+            raise Exception(f"Simulation did not generate log within {max_wait_time} seconds.")
+        time.sleep(5)
+        wait_time += 5
+
+    subprocess.call(["python", "scripts/parser.py", log_file, "--cooja"])
+    return subprocess.check_output(["python", "scripts/analysis.py", ".", "--cooja"], universal_newlines=True)
+
+
+def mean(values):
+    return sum(values) / len(values) if values else float("nan")
+
+
+results = {}
+with open(report_file, "w") as report:
+    for mode, flag in MODES:
+        # the simulation rebuilds the firmware: the make variable goes through the environment
+        env = dict(os.environ, NON_STORING=flag, SINK="0")
+        ram = firmware_ram(env) # router image (the same for all the nodes in storing mode)
+        env["SINK"] = flag
+        sink_ram = firmware_ram(env) if flag == "1" else ram
+        samples = {key: [] for key in PATTERNS}
+        for run in range(1, NUM_RUNS + 1):
+            print(f"Mode {mode}: run {run}/{NUM_RUNS}...")
+            try:
+                analysis_result = run_once(env)
+            except Exception as e:
+                print(f"Error during run {run}/{NUM_RUNS}: {e}")
+                report.write(f"\n{mode} run {run}/{NUM_RUNS} FAILED: {e}\n")
+                continue
+            for key, pattern in PATTERNS.items():
+                match = pattern.search(analysis_result)
+                if match:
+                    samples[key].append(float(match.group(1)))
+            report.write("\n" + "=" * 100 + "\n")
+            report.write(f" Simulation File: {simulation_file} - Mode {mode} - Run {run}/{NUM_RUNS} \n")
+            report.write("=" * 100 + "\n")
+            report.write(analysis_result)
+            report.flush()
+        results[mode] = (ram, sink_ram, samples)
+
+    summary = "\n{:<12} | {:>9} | {:>9} | {:>8} | {:>12} | {:>7} | {:>4}\n".format(
+        "Mode", "RAM (B)", "Sink (B)", "PDR (%)", "Latency (ms)", "DC (%)", "Runs")
+    summary += "-" * 80 + "\n"
+    for mode, (ram, sink_ram, samples) in results.items():
+        summary += "{:<12} | {:>9} | {:>9} | {:>8.2f} | {:>12.2f} | {:>7.2f} | {:>4}\n".format(
+            mode, ram if ram is not None else "n/a", sink_ram if sink_ram is not None else "n/a",
+            mean(samples["pdr"]), mean(samples["latency"]), mean(samples["dc"]), len(samples["pdr"]))
+    print(summary)
+    report.write(summary)
+
+# do not leave non-storing objects behind for the next default build
+subprocess.call(["make", "TARGET=sky", "clean"])
+
+print(f"Mode benchmark completed. Results saved in {report_file}")
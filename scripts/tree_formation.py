@@ -0,0 +1,108 @@
+#!/usr/bin/env python3
+
+import re
+import sys
+import os.path
+
+# Time to first parent of every node and network-wide tree formation time, from the
+# "App: I am ..." boot lines and the "RP: Joined" / "RP: Orphaned" lines of a simulation
+# or testbed log. Rejoins (orphaned -> joined) are reported as well. The RP lines are printed
+# only by firmware built with RP_CONF_LOG_TREE set to 1 (the default, see include/rp.h).
+
+
+def to_seconds(ts):
+    # Cooja: microseconds or [mm:]ss.ms; testbed: hh:mm:ss,ms
+    ts = ts.replace(',', '.')
+    if ':' not in ts:
+        return float(ts) / 1e6
+    secs = 0.0
+    for field in ts.split(':'):
+        secs = secs * 60 + float(field)
+    return secs
+
+
+def parse_file(log_file, testbed):
+    if testbed:
+        start_record_pattern = r"\[[0-9\-]+ (?P<time>[0-9,:]+)\] INFO:firefly.(?P<self_id>\d+): \d+.firefly < b'"
+        end_record_pattern = "'"
+    else:
+        start_record_pattern = r"(?P<time>[\w:.]+)\s+ID:(?P<self_id>\d+)\s+"
+        end_record_pattern = ""
+
+    regex_node = re.compile(start_record_pattern + r"App: I am (?P<role>normal node|sink) \w+:\w+" + end_record_pattern)
+    regex_join = re.compile(start_record_pattern + r"RP: Joined parent \w+:\w+ hops (?P<hops>\d+)" + end_record_pattern)
+    regex_orphan = re.compile(start_record_pattern + r"RP: Orphaned" + end_record_pattern)
+
+    boot = {}        # node id -> boot time
+    sink = None
+    first_join = {}  # node id -> (time to first parent, hops)
+    orphaned = {}    # node id -> time the parent was lost
+    rejoins = []     # rejoin delays
+
+    with open(log_file, 'r') as f:
+        for line in f:
+            line = line.rstrip()
+
+            m = regex_node.match(line)
+            if m:
+                node_id = int(m.group("self_id"))
+                boot[node_id] = to_seconds(m.group("time"))
+                if m.group("role") == "sink":
+                    sink = node_id
+                continue
+
+            m = regex_join.match(line)
+            if m:
+                node_id = int(m.group("self_id"))
+                t = to_seconds(m.group("time"))
+                if node_id not in first_join:
+                    first_join[node_id] = (t - boot.get(node_id, 0.0), int(m.group("hops")))
+                elif node_id in orphaned:
+                    rejoins.append(t - orphaned.pop(node_id))
+                continue
+
+            m = regex_orphan.match(line)
+            if m:
+                orphaned[int(m.group("self_id"))] = to_seconds(m.group("time"))
+
+    nodes = sorted(n for n in boot if n != sink)
+    print("{:>6} | {:>22} | {:>4}".format("Node", "Time to 1st parent (s)", "Hops"))
+    print("-" * 38)
+    for n in nodes:
+        if n in first_join:
+            print("{:>6} | {:>22.2f} | {:>4}".format(n, first_join[n][0], first_join[n][1]))
+        else:
+            print("{:>6} | {:>22} | {:>4}".format(n, "never", "-"))
+
+    joined = [first_join[n][0] for n in nodes if n in first_join]
+    print("")
+    if joined:
+        # the tree is formed when the last node joins, counted from the boot of the sink
+        start = boot.get(sink, min(boot.values()))
+        formation = max(first_join[n][0] + boot[n] for n in nodes if n in first_join) - start
+        print("Average time to first parent: {:.2f} s".format(sum(joined) / len(joined)))
+        print("Tree formation time: {:.2f} s ({}/{} nodes joined)".format(formation, len(joined), len(nodes)))
+    else:
+        print("No node joined the tree (is the firmware built with RP_CONF_LOG_TREE set to 1?)")
+    if rejoins:
+        print("Rejoins: {}, average time to rejoin: {:.2f} s".format(len(rejoins), sum(rejoins) / len(rejoins)))
+    if orphaned:
+        print("Orphaned at the end of the log: {}".format(sorted(orphaned)))
+
+
+if __name__ == '__main__':
+    import argparse
+
+    parser = argparse.ArgumentParser(prog='TreeFormation')
+    parser.add_argument('filepath', type=str, help='Path of the .log file')
+
+    parser.add_argument('--testbed', dest='testbed', default=False, action='store_true',  help='Parse as a testbed log')
+    parser.add_argument('--cooja',   dest='testbed', default=False, action='store_false', help='Parse as a cooja log')
+
+    args = parser.parse_args()
+
+    if not os.path.isfile(args.filepath):
+        print("Error: No such file ({}).".format(args.filepath))
+        sys.exit(1)
+
+    parse_file(args.filepath, args.testbed)
@@ -0,0 +1,217 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+#include "dsc_tbl.h"
+/*---------------------------------------------------------------------------*/
+
+#if DSC_TBL_SIZE > 0
+
+#define DSC_TBL_MASK (DSC_TBL_SIZE - 1)
+
+static dsc_entry_t dsc_tbl[DSC_TBL_SIZE];
+static uint16_t dsc_cnt;
+
+#if DSC_TBL_BY_VIA
+/*chain heads: every next hop is a child, so there is at most one per nbr table entry*/
+typedef struct{
+  linkaddr_t via;   //linkaddr_null marks a free head
+  linkaddr_t first; //first descendant of the chain
+} dsc_via_t;
+
+static dsc_via_t dsc_via[NBR_TABLE_CONF_MAX_NEIGHBORS];
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*multiplicative hash of the 2-byte address, folded on the table size*/
+static inline uint16_t dsc_hash(const linkaddr_t* addr){
+  uint16_t h = (uint16_t)(((uint16_t)addr->u8[0] << 8) | addr->u8[1]);
+  h = (uint16_t)(h * 40503u); /* 2^16 / golden ratio */
+  h ^= h >> 8;
+  return h & DSC_TBL_MASK;
+}
+
+static inline bool dsc_empty(const dsc_entry_t* e){
+  return linkaddr_cmp(&e->addr, &linkaddr_null);
+}
+
+/*returns the slot holding addr, or the empty slot where the probe sequence ended*/
+static uint16_t dsc_probe(const linkaddr_t* addr){
+  uint16_t i = dsc_hash(addr);
+  while(!dsc_empty(&dsc_tbl[i]) && !linkaddr_cmp(&dsc_tbl[i].addr, addr))
+    i = (i + 1) & DSC_TBL_MASK; //terminates: the table is never full
+  return i;
+}
+
+/*---------------------------------------------------------------------------*/
+
+#if DSC_TBL_BY_VIA
+/*head of the chain of via (a free one, claimed, if alloc is set). NULL if there is none*/
+static dsc_via_t* via_head(const linkaddr_t* via, bool alloc){
+  dsc_via_t* free_head = NULL;
+  uint8_t i;
+  for(i = 0; i < NBR_TABLE_CONF_MAX_NEIGHBORS; i++){
+    if(linkaddr_cmp(&dsc_via[i].via, via)) return &dsc_via[i];
+    if(free_head == NULL && linkaddr_cmp(&dsc_via[i].via, &linkaddr_null)) free_head = &dsc_via[i];
+  }
+  if(!alloc || free_head == NULL) return NULL;
+  linkaddr_copy(&free_head->via, via);
+  linkaddr_copy(&free_head->first, &linkaddr_null);
+  return free_head;
+}
+
+/*takes e out of the chain of its next hop, freeing the head of an empty chain*/
+static void via_unlink(const dsc_entry_t* e){
+  dsc_via_t* v = via_head(&e->nexthop, false);
+  if(v == NULL) return; //cannot happen: every entry is chained
+  if(linkaddr_cmp(&v->first, &e->addr))
+    linkaddr_copy(&v->first, &e->sib);
+  else{
+    dsc_entry_t* p = &dsc_tbl[dsc_probe(&v->first)];
+    while(!linkaddr_cmp(&p->sib, &e->addr) && !linkaddr_cmp(&p->sib, &linkaddr_null))
+      p = &dsc_tbl[dsc_probe(&p->sib)];
+    if(linkaddr_cmp(&p->sib, &e->addr)) linkaddr_copy(&p->sib, &e->sib);
+  }
+  if(linkaddr_cmp(&v->first, &linkaddr_null)) linkaddr_copy(&v->via, &linkaddr_null);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+
+void dsc_tbl_init(void){
+  dsc_tbl_flush();
+}
+
+/*---------------------------------------------------------------------------*/
+
+void dsc_tbl_flush(void){
+  uint16_t i;
+  for(i = 0; i < DSC_TBL_SIZE; i++)
+    linkaddr_copy(&dsc_tbl[i].addr, &linkaddr_null);
+  dsc_cnt = 0;
+#if DSC_TBL_BY_VIA
+  for(i = 0; i < NBR_TABLE_CONF_MAX_NEIGHBORS; i++)
+    linkaddr_copy(&dsc_via[i].via, &linkaddr_null);
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool dsc_tbl_lookup(const linkaddr_t* addr, linkaddr_t* nexthop){
+  if(linkaddr_cmp(addr, &linkaddr_null)) return false;
+  const dsc_entry_t* e = &dsc_tbl[dsc_probe(addr)];
+  if(dsc_empty(e)) return false;
+  linkaddr_copy(nexthop, &e->nexthop);
+  return true;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool dsc_tbl_add(const linkaddr_t* addr, const linkaddr_t* nexthop){
+  if(linkaddr_cmp(addr, &linkaddr_null)) return false;
+  dsc_entry_t* e = &dsc_tbl[dsc_probe(addr)];
+  bool empty = dsc_empty(e);
+  if(empty && dsc_cnt >= DSC_TBL_MAX_ENTRIES) return false; //table full
+#if DSC_TBL_BY_VIA
+  if(!empty && linkaddr_cmp(&e->nexthop, nexthop)) return true; //nothing changes
+  dsc_via_t* v = via_head(nexthop, true);
+  if(v == NULL) return false; //cannot happen: one head per child
+  if(!empty) via_unlink(e); //moved to another child
+#endif
+  if(empty){
+    linkaddr_copy(&e->addr, addr);
+    dsc_cnt++;
+  }
+  linkaddr_copy(&e->nexthop, nexthop); //new entry, or descendant moved to another child
+#if DSC_TBL_BY_VIA
+  linkaddr_copy(&e->sib, &v->first);
+  linkaddr_copy(&v->first, addr);
+#else
+  e->age = 0; //refreshed
+#endif
+  return true;
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool dsc_tbl_remove(const linkaddr_t* addr){
+  if(linkaddr_cmp(addr, &linkaddr_null)) return false;
+  uint16_t hole = dsc_probe(addr);
+  if(dsc_empty(&dsc_tbl[hole])) return false;
+#if DSC_TBL_BY_VIA
+  via_unlink(&dsc_tbl[hole]);
+#endif
+
+  /*backward shift deletion: move back the following entries of the cluster that
+    would not be reachable anymore through the hole, so no tombstones are needed*/
+  uint16_t i = hole;
+  while(1){
+    i = (i + 1) & DSC_TBL_MASK;
+    if(dsc_empty(&dsc_tbl[i])) break;
+    uint16_t home = dsc_hash(&dsc_tbl[i].addr);
+    //the entry can fill the hole if its home slot is not cyclically in (hole, i]
+    if(((i - home) & DSC_TBL_MASK) >= ((i - hole) & DSC_TBL_MASK)){
+      dsc_tbl[hole] = dsc_tbl[i];
+      hole = i;
+    }
+  }
+  linkaddr_copy(&dsc_tbl[hole].addr, &linkaddr_null);
+  dsc_cnt--;
+  return true;
+}
+
+/*---------------------------------------------------------------------------*/
+
+#if DSC_TBL_BY_VIA
+bool dsc_tbl_pop_via(const linkaddr_t* via, linkaddr_t* addr){
+  const dsc_via_t* v = via_head(via, false);
+  if(v == NULL) return false;
+  linkaddr_copy(addr, &v->first);
+  return dsc_tbl_remove(addr); //the head of the chain: unlinked in O(1)
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+
+#if !DSC_TBL_BY_VIA
+void dsc_tbl_age(uint8_t max_age){
+  uint16_t i;
+  for(i = 0; i < DSC_TBL_SIZE; i++)
+    if(!dsc_empty(&dsc_tbl[i]) && dsc_tbl[i].age <= max_age) dsc_tbl[i].age++;
+  /*a removal may shift another entry into the slot: check it again*/
+  for(i = 0; i < DSC_TBL_SIZE; i++){
+    while(!dsc_empty(&dsc_tbl[i]) && dsc_tbl[i].age > max_age){
+      linkaddr_t addr = dsc_tbl[i].addr;
+      dsc_tbl_remove(&addr);
+    }
+  }
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+
+const dsc_entry_t* dsc_tbl_get(uint16_t idx){
+  if(idx >= DSC_TBL_SIZE || dsc_empty(&dsc_tbl[idx])) return NULL;
+  return &dsc_tbl[idx];
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint16_t dsc_tbl_count(void){
+  return dsc_cnt;
+}
+
+#else /* DSC_TBL_SIZE == 0: router image of the non-storing mode, no descendants */
+
+void dsc_tbl_init(void){}
+void dsc_tbl_flush(void){}
+bool dsc_tbl_lookup(const linkaddr_t* addr, linkaddr_t* nexthop){ return false; }
+bool dsc_tbl_add(const linkaddr_t* addr, const linkaddr_t* nexthop){ return false; }
+bool dsc_tbl_remove(const linkaddr_t* addr){ return false; }
+void dsc_tbl_age(uint8_t max_age){}
+const dsc_entry_t* dsc_tbl_get(uint16_t idx){ return NULL; }
+uint16_t dsc_tbl_count(void){ return 0; }
+
+#endif /* DSC_TBL_SIZE > 0 */
@@ -0,0 +1,126 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+#include "link_est.h"
+#include "metric.h"
+#include <string.h>
+/*---------------------------------------------------------------------------*/
+
+/*ETX from a single beacon: RSSI, averaged with the LQI if the radio reports it*/
+static etx_q88_t prior_sample(int16_t rssi, uint8_t lqi){
+  etx_q88_t etx = etx_est_rssi(rssi);
+#if LINK_EST_USE_LQI
+  if(lqi == 0) return etx; //not reported
+  etx_q88_t lqi_etx;
+  if(lqi >= LQI_HIGH_REF) lqi_etx = ETX_FP_SCALE;
+  else if(lqi <= LQI_LOW_THR) lqi_etx = 10 * ETX_FP_SCALE;
+  else //linear interpolation, as for the RSSI
+    lqi_etx = ETX_FP_SCALE + ((uint32_t)(LQI_HIGH_REF - lqi) * 9u * ETX_FP_SCALE + (LQI_HIGH_REF - LQI_LOW_THR) / 2)
+                              / (LQI_HIGH_REF - LQI_LOW_THR);
+  return (etx_q88_t)(((uint32_t)etx + lqi_etx + 1) / 2);
+#else
+  return etx;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+
+static uint8_t popcount16(uint16_t v){
+  uint8_t n = 0;
+  for(; v; v &= v - 1) n++;
+  return n;
+}
+
+/*---------------------------------------------------------------------------*/
+
+/*weighted average of the prior, the beacon and the unicast estimates*/
+static void link_est_fuse(link_est_t* le){
+  uint32_t sum = (uint32_t)le->prior * LINK_EST_PRIOR_W;
+  uint16_t w = LINK_EST_PRIOR_W;
+
+  if(le->bc_span > 0){
+    uint16_t mask = (le->bc_span >= 16) ? 0xFFFF : (uint16_t)((1u << le->bc_span) - 1);
+    uint32_t rcv = popcount16(le->bc_map & mask); //at least 1: the last beacon
+    uint32_t bc_etx = ((uint32_t)le->bc_span * le->bc_span * ETX_FP_SCALE) / (rcv * rcv); //1/BRR^2
+    if(bc_etx > ETX_Q88_MAX) bc_etx = ETX_Q88_MAX;
+    sum += bc_etx * le->bc_span;
+    w += le->bc_span;
+  }
+
+  if(le->uc_cnt > 0){
+    uint16_t tx = 0, acks = 0;
+    uint8_t i;
+    for(i = 0; i < le->uc_cnt; i++){
+      uint8_t s = le->uc_win[(le->uc_head + i) % LINK_EST_UC_WINDOW];
+      tx += s & LINK_EST_UC_TX_MASK;
+      if(s & LINK_EST_UC_ACKED) acks++;
+    }
+    //no ACK at all: the ETX is at least one more transmission than the ones already done
+    uint32_t uc_etx = (acks == 0) ? (uint32_t)(tx + 1) * ETX_FP_SCALE : ((uint32_t)tx * ETX_FP_SCALE) / acks;
+    if(uc_etx > ETX_Q88_MAX) uc_etx = ETX_Q88_MAX;
+    sum += uc_etx * LINK_EST_UC_W * le->uc_cnt;
+    w += LINK_EST_UC_W * le->uc_cnt;
+  }
+
+  le->etx = (etx_q88_t)((sum + w / 2) / w);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void link_est_init(link_est_t* le, uint8_t bseq, int16_t rssi, uint8_t lqi){
+  memset(le, 0, sizeof(link_est_t));
+  le->prior = prior_sample(rssi, lqi);
+  le->bc_map = 1;
+  le->bc_last = bseq;
+  le->bc_span = 1;
+  link_est_fuse(le);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void link_est_beacon(link_est_t* le, uint8_t bseq, int16_t rssi, uint8_t lqi){
+  le->prior = (etx_q88_t)(((uint32_t)le->prior * 3 + prior_sample(rssi, lqi) + 2) / 4);
+
+  uint8_t gap = (uint8_t)(bseq - le->bc_last);
+  if(gap == 0) return; //duplicate
+  if(gap >= LINK_EST_BC_WINDOW){ //too many losses, or the neighbor rebooted: start over
+    le->bc_map = 1;
+    le->bc_span = 1;
+  }
+  else{
+    le->bc_map = (uint16_t)(le->bc_map << gap) | 1;
+    le->bc_span = (le->bc_span + gap > LINK_EST_BC_WINDOW) ? LINK_EST_BC_WINDOW : le->bc_span + gap;
+  }
+  le->bc_last = bseq;
+  link_est_fuse(le);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void link_est_tx(link_est_t* le, uint8_t num_tx, bool acked){
+  if(num_tx == 0) return; //nothing went on air
+  if(num_tx > LINK_EST_UC_TX_MASK) num_tx = LINK_EST_UC_TX_MASK;
+  uint8_t s = num_tx | (acked ? LINK_EST_UC_ACKED : 0);
+  if(le->uc_cnt < LINK_EST_UC_WINDOW)
+    le->uc_win[(le->uc_head + le->uc_cnt++) % LINK_EST_UC_WINDOW] = s;
+  else{ //full: overwrite the oldest
+    le->uc_win[le->uc_head] = s;
+    le->uc_head = (le->uc_head + 1) % LINK_EST_UC_WINDOW;
+  }
+  le->uc_fresh = true;
+  link_est_fuse(le);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void link_est_age(link_est_t* le){
+  if(!le->uc_fresh && le->uc_cnt > 0){
+    le->uc_head = (le->uc_head + 1) % LINK_EST_UC_WINDOW;
+    le->uc_cnt--;
+    link_est_fuse(le);
+  }
+  le->uc_fresh = false;
+}
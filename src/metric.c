@@ -12,32 +12,27 @@
 /*---------------------------------------------------------------------------*/
 
 
-float etx_est_rssi(uint16_t rssi){
-  if(rssi > RSSI_HIGH_REF) return 1.0f;
-  if(rssi < RSSI_LOW_THR) return 10.0f;
+etx_q88_t etx_est_rssi(int16_t rssi){
+  if(rssi > RSSI_HIGH_REF) return ETX_FP_SCALE; /* 1.0 */
+  if(rssi < RSSI_LOW_THR) return 10 * ETX_FP_SCALE;
+#if METRIC_FIXED_POINT
+  //linear interpolation between RSSI_HIGH_REF and RSSI_THR
+  const uint32_t span = (uint32_t)(RSSI_HIGH_REF - RSSI_LOW_THR);  /* > 0          */
+  uint32_t offset = (uint32_t)(RSSI_HIGH_REF - (int32_t)rssi);     /* 0 ... span     */
+
+  /* 1  +  frac·9   ->  go from 1 (RSSI_HIGH_REF) ot 10 (RSSI_LOW_THR), rounded */
+  return (etx_q88_t)(ETX_FP_SCALE + (offset * 9u * ETX_FP_SCALE + span / 2) / span);
+#else
   //linear interpolation between RSSI_HIGH_REF and RSSI_THR
   float span   = (float)(RSSI_HIGH_REF - RSSI_LOW_THR);   /* > 0          */
   float offset = (float)(RSSI_HIGH_REF - rssi);       /* 0 ... span     */
   float frac   = offset / span;                       /* 0 ... 1        */
 
   /* 1  +  frac·9   ->  go from 1 (RSSI_HIGH_REF) ot 10 (RSSI_LOW_THR)      */
-  return 1.0f + frac * 9.0f;
+  return (etx_q88_t)((1.0f + frac * 9.0f) * ETX_FP_SCALE + 0.5f);
+#endif
 }
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 
-/*---------------------------------------------------------------------------*/
-/*---------------------------------------------------------------------------*/
-
-float etx_update(uint16_t num_tx, uint16_t num_ack, float o_etx, uint16_t rssi){
-  float n_etx;
-  //if the entry has no acks yet, or no EWMA filtering is applied, default to rssi-based estimation
-  if((num_ack == 0) || (ALPHA == 1)) n_etx = etx_est_rssi(rssi);
-  else{
-    n_etx = ((float)num_tx) / (float)num_ack;
-    // EWMA filtering
-    n_etx = ALPHA * o_etx + (1.0f - ALPHA) * n_etx;
-  }
-  return n_etx;
-}
@@ -6,149 +6,495 @@
 
 #include "nbr_tbl_utils.h"
 #include "rp.h"
+#include <string.h>
 /*---------------------------------------------------------------------------*/
 
-/*Checks in the routing table if there is a nexthop to dest. If not, it returns the parent*/
-inline void nbr_tbl_lookup(nbr_table_t* nbr_tbl, linkaddr_t* nexthop, const linkaddr_t* dst_addr, const linkaddr_t* parent){
+#if SUBTREE_FILTER_BYTES > 0
+#define FILTER_MASK (SUBTREE_FILTER_BYTES * 8 - 1)
+
+/*the two bit positions of an address in the subtree filter*/
+static inline void filter_bits(const linkaddr_t* addr, uint8_t* b1, uint8_t* b2){
+  uint16_t a = (uint16_t)(((uint16_t)addr->u8[0] << 8) | addr->u8[1]);
+  *b1 = (uint8_t)((uint16_t)(a * 40503u) >> 8) & FILTER_MASK;
+  *b2 = (uint8_t)((uint16_t)(a * 28493u) >> 8) & FILTER_MASK;
+}
+
+static inline void filter_add(uint8_t* filter, const linkaddr_t* addr){
+  uint8_t b1, b2;
+  filter_bits(addr, &b1, &b2);
+  filter[b1 >> 3] |= 1 << (b1 & 7);
+  filter[b2 >> 3] |= 1 << (b2 & 7);
+}
+
+static inline bool filter_has(const uint8_t* filter, uint8_t b1, uint8_t b2){
+  return (filter[b1 >> 3] & (1 << (b1 & 7))) && (filter[b2 >> 3] & (1 << (b2 & 7)));
+}
+
+bool subtree_filter_test(const uint8_t* filter, const linkaddr_t* addr){
+  uint8_t b1, b2;
+  filter_bits(addr, &b1, &b2);
+  return filter_has(filter, b1, b2);
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool subtree_filter_build(nbr_table_t* nbr_tbl, uint8_t* filter){
+  memset(filter, 0, SUBTREE_FILTER_BYTES);
+  entry_t* e;
+  for(e = nbr_table_head(nbr_tbl); e != NULL; e = nbr_table_next(nbr_tbl, e))
+    if(e->type == NODE_CHILD)
+      filter_add(filter, nbr_table_get_lladdr(nbr_tbl, e));
+  uint16_t i;
+  for(i = 0; i < DSC_TBL_SIZE; i++){
+    const dsc_entry_t* d = dsc_tbl_get(i);
+    if(d != NULL) filter_add(filter, &d->addr);
+  }
+
+  //with more than half of the bits set the false positives would send too many packets sideways
+  uint8_t set = 0;
+  for(i = 0; i < SUBTREE_FILTER_BYTES; i++){
+    uint8_t b = filter[i];
+    while(b){ set++; b &= b - 1; }
+  }
+  return set > 0 && set <= SUBTREE_FILTER_BYTES * 4;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+
+uint16_t subtree_size(nbr_table_t* nbr_tbl){
+  uint16_t n = dsc_tbl_count(); //empty in the nodes of the non-storing mode: children only
+  entry_t* e;
+  for(e = nbr_table_head(nbr_tbl); e != NULL; e = nbr_table_next(nbr_tbl, e))
+    if(e->type == NODE_CHILD) n++;
+  return n;
+}
+
+/*---------------------------------------------------------------------------*/
+
+typedef struct{
+  linkaddr_t addr;
+  linkaddr_t via; //forwarding hints only
+  clock_time_t time; //when it was added
+} route_note_t;
+
+static route_note_t neg_cache[RP_NEG_CACHE_SIZE];
+#if !RP_NON_STORING
+static route_note_t fwd_hints[RP_FWD_HINT_SIZE];
+#endif
+
+/*slot for addr in a small table: its own, or the oldest one*/
+static route_note_t* note_slot(route_note_t* tbl, uint8_t size, const linkaddr_t* addr){
+  route_note_t* slot = &tbl[0];
+  uint8_t i;
+  for(i = 0; i < size; i++){
+    if(linkaddr_cmp(&tbl[i].addr, addr)) return &tbl[i];
+    if(clock_time() - tbl[i].time > clock_time() - slot->time) slot = &tbl[i];
+  }
+  return slot;
+}
+
+/*valid entry for addr in a small table, NULL if there is none*/
+static const route_note_t* note_find(const route_note_t* tbl, uint8_t size, const linkaddr_t* addr, clock_time_t ttl){
+  uint8_t i;
+  for(i = 0; i < size; i++)
+    if(linkaddr_cmp(&tbl[i].addr, addr) && clock_time() - tbl[i].time < ttl) return &tbl[i];
+  return NULL;
+}
+
+void neg_cache_add(const linkaddr_t* addr){
+  route_note_t* n = note_slot(neg_cache, RP_NEG_CACHE_SIZE, addr);
+  n->addr = *addr;
+  n->time = clock_time();
+}
+
+bool neg_cache_hit(const linkaddr_t* addr){
+  return note_find(neg_cache, RP_NEG_CACHE_SIZE, addr, RP_NEG_CACHE_TTL) != NULL;
+}
+
+#if !RP_NON_STORING
+void fwd_hint_add(const linkaddr_t* dst, const linkaddr_t* via){
+  route_note_t* n = note_slot(fwd_hints, RP_FWD_HINT_SIZE, dst);
+  n->addr = *dst;
+  n->via = *via;
+  n->time = clock_time();
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+
+/*Checks in the routing table if there is a nexthop to dest. If not, it looks for a neighbor
+  whose subtree may contain dest, and finally it returns the parent*/
+void nbr_tbl_lookup(nbr_table_t* nbr_tbl, linkaddr_t* nexthop, const linkaddr_t* dst_addr, const linkaddr_t* parent, const linkaddr_t* prev_hop){
     const entry_t *entry = (entry_t *) nbr_table_get_from_lladdr(nbr_tbl, dst_addr);
   
-    if (entry != NULL)
+    if (entry != NULL){
       linkaddr_copy(nexthop, &entry->nexthop);
-    else
-      linkaddr_copy(nexthop, parent); //default route to parent
+      return;
+    }
+#if !RP_NON_STORING
+    if(dsc_tbl_lookup(dst_addr, nexthop)) return; //downward route to a descendant
+
+    //a former descendant: its old subtree root is still a neighbor and knows the way
+    const route_note_t* h = note_find(fwd_hints, RP_FWD_HINT_SIZE, dst_addr, RP_FWD_HINT_TTL);
+    if(h != NULL && !linkaddr_cmp(&h->via, prev_hop) && nbr_table_get_from_lladdr(nbr_tbl, &h->via) != NULL){
+      linkaddr_copy(nexthop, &h->via);
+      return;
+    }
+#endif
+
+#if SUBTREE_FILTER_BYTES > 0
+    /*Shortcut: among the neighbors advertising dest in their subtree, take the best link.
+      Never hand the packet back to the previous hop, nor to a neighbor in this node's subtree
+      (its subtree cannot contain dest, so it would only send the packet back up here)*/
+    const entry_t* best = NULL;
+    const linkaddr_t* best_addr = NULL;
+    entry_t* e;
+    uint8_t b1, b2;
+    filter_bits(dst_addr, &b1, &b2); //hashed once for all the neighbors
+    for(e = nbr_table_head(nbr_tbl); e != NULL; e = nbr_table_next(nbr_tbl, e)){
+      if(e->type != NODE_NEIGHBOR || !filter_has(e->dsc_filter, b1, b2)) continue; //cheapest tests first
+      const linkaddr_t* e_addr = nbr_table_get_lladdr(nbr_tbl, e);
+      linkaddr_t dsc_nh;
+      if(!VALID(e->age) || linkaddr_cmp(e_addr, prev_hop) || dsc_tbl_lookup(e_addr, &dsc_nh)) continue;
+      if(best == NULL || link_est_etx(&e->le) < link_est_etx(&best->le)){
+        best = e;
+        best_addr = e_addr;
+      }
+    }
+    if(best != NULL){
+      linkaddr_copy(nexthop, best_addr);
+      #if USR_DEBUG == 1
+      printf("nbr_tbl: shortcut to %02x:%02x through neighbor %02x:%02x\n",
+             dst_addr->u8[0], dst_addr->u8[1], best_addr->u8[0], best_addr->u8[1]);
+      #endif
+      return;
+    }
+#endif
+    linkaddr_copy(nexthop, parent); //default route to parent
 }
 
 /*---------------------------------------------------------------------------*/
 
+/*---------------------------------------------------------------------------*/
+/*remove an entry that is not a child, with the descendants that may still be chained to it*/
+static void entry_drop(nbr_table_t* nbr_tbl, struct rp_conn* conn, entry_t* e){
+#if !RP_NON_STORING
+  remove_descendants(conn, *nbr_table_get_lladdr(nbr_tbl, e), false); //no chain: nothing to do
+#endif
+  nbr_entry_remove(nbr_tbl, e);
+}
+
 /*---------------------------------------------------------------------------*/
 void remove_subtree(nbr_table_t* nbr_tbl, struct rp_conn* conn, linkaddr_t ch_addr){
 
-  //remove the subtree: iterate the routing table to find entry of the subtree
-  entry_t* tmp = nbr_table_head(nbr_tbl);
-  while(tmp != NULL){
-    entry_t* nxt_tmp = nbr_table_next(nbr_tbl, tmp); 
+  //remove the child itself from the routing table
+  entry_t* ch_e = nbr_table_get_from_lladdr(nbr_tbl, &ch_addr);
+  if(ch_e != NULL)
+    nbr_entry_remove(nbr_tbl, ch_e);
+#if !RP_NON_STORING
+  tpl_buf_put(conn, &ch_addr, STATUS_REMOVE);
 
-    if(linkaddr_cmp(&tmp->nexthop, &ch_addr)){ //entry being part of the child subtree (child is the root of the subtree)
-      linkaddr_t des_addr = *nbr_table_get_lladdr(nbr_tbl, tmp); 
-      nbr_table_remove(nbr_tbl, tmp); //remove from the routing table
-      stat_addr_t des_stat = {.addr = des_addr, .status = STATUS_REMOVE}; //add to the topology buffer
-      conn->tpl_buf.stat_addr_arr[conn->tpl_buf.size++] = des_stat;
-      #if USR_DEBUG == 1
-      printf("nbr_tbl: removing descedant %02x:%02x from subtree rooted in child entry %02x:%02x\n", des_stat.addr.u8[0], des_stat.addr.u8[1], ch_addr.u8[0], ch_addr.u8[1]);
-      #endif
-    }
-    tmp = nxt_tmp;
+  remove_descendants(conn, ch_addr, false);
+#endif
+}
+
+#if !RP_NON_STORING
+
+/*---------------------------------------------------------------------------*/
+void remove_descendants(struct rp_conn* conn, linkaddr_t ch_addr, bool hint){
+  //remove the subtree: the descendants routed through the child are chained in the descendant table
+  linkaddr_t des_addr;
+  while(dsc_tbl_pop_via(&ch_addr, &des_addr)){
+    tpl_buf_put(conn, &des_addr, STATUS_REMOVE); //add to the topology buffer
+    if(hint) fwd_hint_add(&des_addr, &ch_addr);
+    #if USR_DEBUG == 1
+    printf("nbr_tbl: removing descedant %02x:%02x from subtree rooted in child entry %02x:%02x\n", des_addr.u8[0], des_addr.u8[1], ch_addr.u8[0], ch_addr.u8[1]);
+    #endif
   }
 }
 
 
+#endif
+
 /*---------------------------------------------------------------------------*/
 
 
+static clock_time_t cleanup_at; //when the cleanup timer fires
+static clock_time_t last_link_aging;
+
+void nbr_tbl_cleanup_arm(struct rp_conn* conn, clock_time_t within){
+  if(!ctimer_expired(&conn->nbr_tbl_cleanup_timer) && cleanup_at - clock_time() <= within) return; //early enough
+  cleanup_at = clock_time() + within;
+  ctimer_set(&conn->nbr_tbl_cleanup_timer, within, nbr_tbl_cleanup_cb, &conn->clu_args);
+}
+
 /*callback for flushing the routing table from expired entries*/
 void nbr_tbl_cleanup_cb(void *ptr) {
    cb_args_t* args = (cb_args_t*) ptr;
    struct rp_conn* conn = args->conn;
    nbr_table_t* nbr_tbl =args->nbr_tbl;
-   
-
-   //need to do this in two sweeps to avoid dangling pointers while iterating the table
-   entry_t* stales[NBR_TABLE_CONF_MAX_NEIGHBORS]; //array of stale entries
-   uint8_t stales_count = 0;
    bool parent_change = false;
+   bool age_links = clock_time() - last_link_aging >= NBR_TBL_CLEANUP_INTERVAL;
+   bool uc_samples = false; //some link still has unicast samples to age
+   clock_time_t next = ENTRY_EXPIRATION_TIME; //time to the next deadline
+   if(age_links) last_link_aging = clock_time();
 
-   // pass 1: iterate over the routing table and find expired entries (skip descendants since we don't know if they are expired) 
-   entry_t* e;
-   for (e = nbr_table_head(nbr_tbl); e != NULL; e= nbr_table_next(nbr_tbl, e))
-    if(!(VALID(e->age)) && (e->type != NODE_DESCENDANT))
-        stales[stales_count++] = e;
-    
-
-    //pass 2: removing the entries
-  uint8_t i;
-  for(i=0; i< stales_count; i++){
-    
-      if(stales[i]->type == NODE_CHILD)
-          remove_subtree(nbr_tbl, conn, *nbr_table_get_lladdr(nbr_tbl, stales[i]));
-      else if (stales[i]->type == NODE_PARENT){ //if the parent is being removed, then you need to change the parent
-          nbr_table_remove(nbr_tbl, stales[i]);
-          parent_change = true;
-          conn->parent = linkaddr_null;
-          //conn->tpl_buf.stat_addr_arr[conn->tpl_buf.size++] = (stat_addr_t){.addr = *nbr_table_get_lladdr(nbr_tbl, stales[i]), .status = STATUS_REMOVE};
-      }
-      else{ //if not a child nor a parent, then it is a neighbor (or a descendant during the state reset on receiving a new beacon)
-          nbr_table_remove(nbr_tbl, stales[i]);
-          //conn->tpl_buf.stat_addr_arr[conn->tpl_buf.size++] = (stat_addr_t){.addr = *nbr_table_get_lladdr(nbr_tbl, stales[i]), .status = STATUS_REMOVE};
+   //single sweep: the next entry is fetched before the current one is removed
+   //(descendants are not here, they are in the descendant table)
+   entry_t *e, *e_next;
+   for(e = nbr_table_head(nbr_tbl); e != NULL; e = e_next){
+    e_next = nbr_table_next(nbr_tbl, e);
+    if(!VALID(e->age)){
+      if(e->type == NODE_CHILD)
+          remove_subtree(nbr_tbl, conn, *nbr_table_get_lladdr(nbr_tbl, e));
+      else{ //if the parent is being removed, then you need to change the parent
+          if(e->type == NODE_PARENT){
+              parent_change = true;
+              conn->parent = linkaddr_null;
+          }
+          entry_drop(nbr_tbl, conn, e);
       }
-     
-  
-  }
+      continue;
+    }
+    if(age_links){
+        link_est_age(&e->le); //forget unicast samples of idle links
+        par_cand_update(e);
+    }
+    if(link_est_uc_samples(&e->le)) uc_samples = true;
+    clock_time_t left = ENTRY_EXPIRATION_TIME - (clock_time() - e->age);
+    if(left < next) next = left;
+   }
 
-    /* Schedule next cleanup */
-    ctimer_reset(&conn->nbr_tbl_cleanup_timer);
+    /* Schedule the next cleanup at the earliest deadline: an entry expiring or, while some link has
+       unicast samples, the next aging. Nothing to do with an empty table */
+    if(uc_samples && NBR_TBL_CLEANUP_INTERVAL - (clock_time() - last_link_aging) < next)
+        next = NBR_TBL_CLEANUP_INTERVAL - (clock_time() - last_link_aging);
+    if(nbr_table_head(nbr_tbl) != NULL){
+        cleanup_at = clock_time() + next;
+        ctimer_set(&conn->nbr_tbl_cleanup_timer, next, nbr_tbl_cleanup_cb, args);
+    }
+    else
+        ctimer_stop(&conn->nbr_tbl_cleanup_timer);
     //change parent if the parent is expired
     if(parent_change) change_parent(args);
 }
 
 /*---------------------------------------------------------------------------*/
 
-/*update the neighbor table based on the incoming topology report, and update the local topology buffer*/
-void nbr_tbl_update(nbr_table_t* nbr_tbl, struct rp_conn* conn, const linkaddr_t* tx_addr, tpl_vec_t net_buf){
+#if !RP_NON_STORING
+/*update the neighbor table based on the incoming topology report, and book for the parent only
+  the changes that are news for the ancestors*/
+void nbr_tbl_update(nbr_table_t* nbr_tbl, struct rp_conn* conn, const linkaddr_t* tx_addr, const tpl_vec_t* net_buf){
 
   entry_t* tx_entry = nbr_table_get_from_lladdr(nbr_tbl, tx_addr);
   if(tx_entry && tx_entry->type == NODE_NEIGHBOR){ //if it is a neighbor that chose this node as a parent, book the change into the buffer
-    stat_addr_t tx_stat = {.addr = *tx_addr, .status = STATUS_ADD};
-    conn->tpl_buf.stat_addr_arr[conn->tpl_buf.size++] = tx_stat;
+    tpl_buf_put(conn, tx_addr, STATUS_ADD);
     tx_entry->adv_metric = METRIC_Q124_INF; //set infinite metric to avoid loops
+    par_cand_update(tx_entry);
   } //else it is an already known child
 
   //update the routing table and the local buffer with the info contained in the topology report
   uint8_t i;
-  for(i=0; i<net_buf.size; i++){ 
-      if(conn->tpl_buf.size >= NBR_TABLE_CONF_MAX_NEIGHBORS) {
-        #if USR_DEBUG
-          uint8_t skip_count = net_buf.size - i;
-          printf("nbr_tbl: buffer overflow, skipping %u entries starting from entry %02x:%02x\n",
-                       skip_count, net_buf.stat_addr_arr[i].addr.u8[0], net_buf.stat_addr_arr[i].addr.u8[1]);
-        #endif
-          break;
-      }
-  
-      //copy the report into the buffer
-      //putting this line here implies that also entris in STATUS_ADD but already in this nbr_tbl
-      //will be propagatd upwards: harmless, but is useless information.
-      //This should be changed to avoid transmitting redundancies
-      conn->tpl_buf.stat_addr_arr[conn->tpl_buf.size++] = net_buf.stat_addr_arr[i];
-  
-      const linkaddr_t* d_addr = &(net_buf.stat_addr_arr[i].addr);
-      uint8_t status = net_buf.stat_addr_arr[i].status;
+  for(i=0; i<net_buf->size; i++){ 
+      linkaddr_t d_addr = net_buf->stat_addr_arr[i].addr;
+      uint8_t status = net_buf->stat_addr_arr[i].status;
+
+      linkaddr_t d_nh;
+      bool known = dsc_tbl_lookup(&d_addr, &d_nh);
   
-      if(status == STATUS_ADD){ //add descendant entry in the neighbor table
-        //add descendant entry in the neighbor table
-          entry_t* d_entry = (entry_t*) nbr_table_add_lladdr(nbr_tbl, d_addr, NBR_TABLE_REASON_ROUTE, NULL);
-          if(d_entry != NULL){
-            d_entry->type = NODE_DESCENDANT;
-            d_entry->adv_metric = METRIC_Q124_INF; //avoid loops
-            d_entry->age = ALWAYS_VALID_AGE; //no need to keep track of it: the topology report will remove the descendants if necessary
-            d_entry->hops = 0xFF; // not used
-            d_entry->nexthop = *tx_addr; 
+      if(status == STATUS_ADD){ //add descendant entry in the descendant table
+          if(known && linkaddr_cmp(&d_nh, tx_addr))
+              continue; //already known through this child: nothing new
+          //no need to keep track of its age: the topology report will remove the descendants if necessary
+          if(!dsc_tbl_add(&d_addr, tx_addr)){
+            #if USR_DEBUG == 1
+            printf("nbr_tbl: descendant table full, dropping descendant %02x:%02x\n", d_addr.u8[0], d_addr.u8[1]);
+            #endif
+            continue;
           }
           #if USR_DEBUG == 1
           printf("nbr_tbl: new descendant %02x:%02x, from child %02x:%02x\n", 
-            d_addr->u8[0], d_addr->u8[1], tx_addr->u8[0], tx_addr->u8[1]);
+            d_addr.u8[0], d_addr.u8[1], tx_addr->u8[0], tx_addr->u8[1]);
           #endif
+          if(known)
+              continue; //moved from another child of this node: the ancestors already route it here
       }
   
       else if (status == STATUS_REMOVE){
-          entry_t* d_entry = nbr_table_get_from_lladdr(nbr_tbl, d_addr);
-          if(d_entry != NULL){//if the entry exist, remove it
-            nbr_table_remove(nbr_tbl, d_entry);
-            #if USR_DEBUG == 1
-            printf("nbr_tbl: removing descendant %02x:%02x, from subtree rooted in child %02x:%02x\n", 
-              d_addr->u8[0], d_addr->u8[1], tx_addr->u8[0], tx_addr->u8[1]);
-            #endif
-          }
+          if(!known || !linkaddr_cmp(&d_nh, tx_addr))
+              continue; //unknown, or moved under another child of this node: the route is still valid, and the ancestors do not have to know
+          dsc_tbl_remove(&d_addr);
+          #if USR_DEBUG == 1
+          printf("nbr_tbl: removing descendant %02x:%02x, from subtree rooted in child %02x:%02x\n", 
+            d_addr.u8[0], d_addr.u8[1], tx_addr->u8[0], tx_addr->u8[1]);
+          #endif
+      }
+
+      if(!tpl_buf_put(conn, &d_addr, status)) {
+        #if USR_DEBUG
+          printf("nbr_tbl: buffer overflow, change of %02x:%02x not reported\n", d_addr.u8[0], d_addr.u8[1]);
+        #endif
       }
     }
 
 }
+
+/*---------------------------------------------------------------------------*/
+
+bool tpl_buf_put(struct rp_conn* conn, const linkaddr_t* addr, uint8_t status){
+  tpl_buf_t* b = &conn->tpl_buf;
+  uint16_t i;
+  for(i = conn->sent_off; i < b->size; i++){
+    linkaddr_t a = b->stat_addr_arr[i].addr; //aligned copy of the packed field
+    if(!linkaddr_cmp(&a, addr)) continue;
+    if(b->stat_addr_arr[i].status == status) return true; //already booked
+    //opposite change: the two cancel out
+    memmove(&b->stat_addr_arr[i], &b->stat_addr_arr[i + 1], (b->size - i - 1) * sizeof(stat_addr_t));
+    b->size--;
+    return true;
+  }
+  if(b->size >= TPL_BUF_CAP) return false;
+  b->stat_addr_arr[b->size].addr = *addr;
+  b->stat_addr_arr[b->size].status = status;
+  b->size++;
+  return true;
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*-----------------------------PARENT CANDIDATES-----------------------------*/
+
+static entry_t* cand_heap[NBR_TABLE_CONF_MAX_NEIGHBORS];
+static uint8_t cand_cnt;
+
+static inline void cand_place(entry_t* e, uint8_t pos){
+  cand_heap[pos] = e;
+  e->cand_pos = pos;
+}
+
+static void cand_sift_up(uint8_t pos){
+  entry_t* e = cand_heap[pos];
+  while(pos > 0){
+    uint8_t up = (pos - 1) / 2;
+    if(cand_heap[up]->cand_mt <= e->cand_mt) break;
+    cand_place(cand_heap[up], pos);
+    pos = up;
+  }
+  cand_place(e, pos);
+}
+
+static void cand_sift_down(uint8_t pos){
+  entry_t* e = cand_heap[pos];
+  while(1){
+    uint8_t ch = 2 * pos + 1;
+    if(ch >= cand_cnt) break;
+    if(ch + 1 < cand_cnt && cand_heap[ch + 1]->cand_mt < cand_heap[ch]->cand_mt) ch++;
+    if(e->cand_mt <= cand_heap[ch]->cand_mt) break;
+    cand_place(cand_heap[ch], pos);
+    pos = ch;
+  }
+  cand_place(e, pos);
+}
+
+static void cand_remove(entry_t* e){
+  uint8_t pos = e->cand_pos;
+  e->cand_pos = PAR_CAND_NONE;
+  cand_cnt--;
+  if(pos == cand_cnt) return; //it was the last one
+  entry_t* last = cand_heap[cand_cnt];
+  cand_place(last, pos); //move the last one in the hole, then restore the heap order
+  cand_sift_up(pos);
+  cand_sift_down(last->cand_pos);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void par_cand_init(void){
+  cand_cnt = 0;
+}
+
+/*---------------------------------------------------------------------------*/
+
+void par_cand_update(entry_t* e){
+  bool eligible = e->type == NODE_NEIGHBOR && e->adv_metric != METRIC_Q124_INF && e->age != ALWAYS_INVALID_AGE;
+  if(!eligible){
+    if(e->cand_pos != PAR_CAND_NONE) cand_remove(e);
+    return;
+  }
+  metric_q124_t old_mt = e->cand_mt;
+  e->cand_mt = nbr_path_metric(e);
+  if(e->cand_pos == PAR_CAND_NONE){
+    if(cand_cnt >= NBR_TABLE_CONF_MAX_NEIGHBORS) return; //cannot happen: one slot per nbr entry
+    cand_place(e, cand_cnt++);
+    cand_sift_up(e->cand_pos);
+  }
+  else if(e->cand_mt < old_mt)
+    cand_sift_up(e->cand_pos);
+  else if(e->cand_mt > old_mt)
+    cand_sift_down(e->cand_pos);
+}
+
+/*---------------------------------------------------------------------------*/
+
+void par_cand_removed(void* item){
+  entry_t* e = (entry_t*) item;
+  if(e->cand_pos != PAR_CAND_NONE) cand_remove(e);
+}
+
+/*---------------------------------------------------------------------------*/
+
+entry_t* par_cand_best(void){
+  return cand_cnt > 0 ? cand_heap[0] : NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------ADMISSION---------------------------------*/
+
+/*one of the RP_NBR_PROTECTED best parent candidates*/
+static bool cand_protected(const entry_t* e){
+  if(e->cand_pos == PAR_CAND_NONE) return false;
+  uint8_t i, better = 0;
+  for(i = 0; i < cand_cnt; i++)
+    if(cand_heap[i]->cand_mt < e->cand_mt && ++better >= RP_NBR_PROTECTED) return false;
+  return true;
+}
+
+/*eviction key: path metric through the entry, the worst one if it cannot be a parent*/
+static inline metric_q124_t evict_mt(const entry_t* e){
+  return (e->cand_pos == PAR_CAND_NONE) ? METRIC_Q124_INF : e->cand_mt;
+}
+
+/*true if a goes before b: stale first, then the worst path metric, then the least recently heard*/
+static bool evict_before(const entry_t* a, const entry_t* b){
+  if(VALID(a->age) != VALID(b->age)) return !VALID(a->age);
+  if(evict_mt(a) != evict_mt(b)) return evict_mt(a) > evict_mt(b);
+  return (clock_time() - a->age) > (clock_time() - b->age);
+}
+
+/*---------------------------------------------------------------------------*/
+
+entry_t* nbr_tbl_admit(nbr_table_t* nbr_tbl, struct rp_conn* conn, const linkaddr_t* addr, metric_q124_t new_mt, bool child){
+  entry_t *e, *victim = NULL;
+  uint8_t cnt = 0;
+  for(e = nbr_table_head(nbr_tbl); e != NULL; e = nbr_table_next(nbr_tbl, e)) cnt++;
+
+  if(cnt >= NBR_TABLE_CONF_MAX_NEIGHBORS){ //full: make room, only for a better node
+    for(e = nbr_table_head(nbr_tbl); e != NULL; e = nbr_table_next(nbr_tbl, e)){
+      if(e->type != NODE_NEIGHBOR || linkaddr_cmp(nbr_table_get_lladdr(nbr_tbl, e), &conn->backup)) continue; //parent, children and backup stay
+      if(VALID(e->age) && cand_protected(e)) continue;
+      if(victim == NULL || evict_before(e, victim)) victim = e;
+    }
+    if(victim == NULL && child){ //a child takes the place of any neighbor
+      for(e = nbr_table_head(nbr_tbl); e != NULL; e = nbr_table_next(nbr_tbl, e))
+        if(e->type == NODE_NEIGHBOR && (victim == NULL || evict_before(e, victim))) victim = e;
+    }
+    if(victim == NULL || (!child && VALID(victim->age) && evict_mt(victim) <= new_mt)) return NULL;
+    #if USR_DEBUG == 1
+    linkaddr_t* v_addr = nbr_table_get_lladdr(nbr_tbl, victim);
+    printf("rp: nbr table full, evicting %02x:%02x for %02x:%02x\n", v_addr->u8[0], v_addr->u8[1], addr->u8[0], addr->u8[1]);
+    #endif
+    entry_drop(nbr_tbl, conn, victim);
+  }
+  return (entry_t*) nbr_table_add_lladdr(nbr_tbl, addr, NBR_TABLE_REASON_ROUTE, NULL);
+}
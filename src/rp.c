@@ -10,9 +10,13 @@
 /*---------------------------------------------------------------------------*/
 #include "rp.h"
 #include "metric.h"
+#if LOAD_METRIC
+#include "simple-energest.h"
+#endif
 /*---------------------------------------------------------------------------*/
 
 NBR_TABLE(entry_t, nbr_tbl); //nbr table registration
+MEMB(tx_q_memb, struct rp_tx_item, RP_TX_QUEUE_SIZE); //pool of the transmit queue items
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
@@ -21,7 +25,9 @@ NBR_TABLE(entry_t, nbr_tbl); //nbr table registration
 /*____________________________USR_DEBUG____________________________*/
 
 static void rp_print_routing_table(struct rp_conn *conn); 
-static void print_topology_report(const linkaddr_t* child_addr); 
+#if !RP_NON_STORING
+static void print_topology_report(const linkaddr_t* child_addr, const tpl_vec_t* report); 
+#endif
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 
@@ -30,7 +36,9 @@ static void print_topology_report(const linkaddr_t* child_addr);
 /*---------------------------------------------------------------------------*/
 /*----------------------------------TIMERS-----------------------------------*/
 static struct ctimer subtree_report_timer; //timer for topology reports
-static struct ctimer nbr_tbl_cleanup_timer;
+#if RP_NON_STORING && RP_SINK_IMAGE
+static struct ctimer par_map_timer; //aging of the parent map (sink only)
+#endif
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
@@ -39,8 +47,30 @@ static struct ctimer nbr_tbl_cleanup_timer;
 /*Callbacks declarations*/
 static void bc_recv(struct broadcast_conn *b_conn, const linkaddr_t *tx_addr);
 static void uc_recv(struct unicast_conn *u_conn, const linkaddr_t *from);
+static void uc_dispatch(struct rp_conn* conn, const linkaddr_t* tx_addr);
+static void rerr_send(struct rp_conn* conn, const linkaddr_t* src, const linkaddr_t* dst);
+#if RP_NON_STORING
+static int sr_send(struct rp_conn* conn, struct uc_hdr hdr);
+static void sr_forward(struct rp_conn* conn, struct uc_hdr hdr);
+static void par_rpt_recv(struct rp_conn* conn, struct uc_hdr hdr);
+#if RP_SINK_IMAGE
+static void par_map_timer_cb(void* ptr);
+#endif
+#else
+static void report_apply(struct rp_conn* conn, const linkaddr_t* tx_addr, const uint8_t* buf, uint16_t len);
+static uint8_t tpl_piggyback(struct rp_conn* conn, uint8_t* buf, uint8_t max_len);
+static uint8_t rpt_frag_encode(struct rp_conn* conn, uint8_t* buf, uint8_t max_len, rpt_frag_t* rec);
+static void rpt_frag_commit(struct rp_conn* conn, const rpt_frag_t* rec);
+static void rpt_timer_cb(void* ptr);
+static void rpt_ack_apply(struct rp_conn* conn, const linkaddr_t* tx_addr, uint8_t seq, uint8_t ff);
+static uint8_t rpt_ack_piggyback(const linkaddr_t* nexthop, uint8_t* buf, uint8_t max_len);
+static void rpt_ack_timer_cb(void* ptr);
+static void rpt_frag_lost(struct rp_conn* conn);
+static uint8_t uc_tlv_room(void);
+#endif
 static void uc_sent(struct unicast_conn* c, int status, int num_tx);
-static void beacon_timer_cb(void* ptr);
+static void beacon_timer_cb(void* ptr, uint8_t suppress);
+static void epoch_timer_cb(void* ptr);
 
 /*Initialize Rime Callback structs*/
 struct broadcast_callbacks bc_cb = {.recv = bc_recv, .sent = NULL};
@@ -49,6 +79,39 @@ struct unicast_callbacks uc_cb = {.recv = uc_recv, .sent = uc_sent};
 //Topology maintenance functions
 static void reset_connection_status(struct rp_conn* conn, uint16_t seqn, bool sink);
 static inline void flush_tpl_buf(struct rp_conn* conn);
+static void beacon_reset(struct rp_conn* conn);
+static void solicit_start(struct rp_conn* conn);
+static void solicit_timer_cb(void* ptr);
+static void buff_subtree(nbr_table_t* nbr_tbl, struct rp_conn* conn);
+static void backup_select(struct rp_conn* conn);
+static void backup_update(struct rp_conn* conn, const linkaddr_t* addr, const entry_t* e);
+static bool parent_failover(struct rp_conn* conn);
+static void parent_switch(struct rp_conn* conn, entry_t* new_par_e);
+static void parent_reeval(struct rp_conn* conn);
+static void tx_q_redirect(struct rp_conn* conn, const linkaddr_t* old_par);
+
+//Wire format functions
+static bool uc_hdr_push(const struct uc_hdr* hdr, const uint8_t* tlv, uint8_t tlv_len);
+static void uc_hdr_rank(const struct rp_conn* conn, struct uc_hdr* hdr, const linkaddr_t* nexthop);
+static bool rank_check(struct rp_conn* conn, struct uc_hdr* hdr);
+static bool uc_hdr_pull(struct uc_hdr* hdr, const linkaddr_t* tx_addr, uint8_t* tlv, uint8_t* tlv_len);
+static const uint8_t* tlv_find(const uint8_t* tlv, uint8_t tlv_len, uint8_t type, uint8_t* len);
+static void bc_msg_write(const struct bc_msg* msg, const uint8_t* tlv, uint8_t tlv_len);
+static bool bc_msg_read(struct bc_msg* msg, uint8_t* tlv, uint8_t* tlv_len);
+
+//Transmit queue functions
+static int tx_q_push(struct rp_conn* conn, const linkaddr_t* nexthop, uint8_t type);
+static int tx_q_enqueue(struct rp_conn* conn, const linkaddr_t* nexthop, uint8_t type);
+static void tx_q_pop(struct rp_conn* conn, int status);
+static void tx_q_send_next(struct rp_conn* conn);
+static void tx_late_set(struct rp_conn* conn, int status, int num_tx);
+static void tx_late_cb(void* ptr);
+static void cong_update(struct rp_conn* conn, bool drop);
+static bool parent_saturated(const struct rp_conn* conn);
+#if RP_AGG
+static bool tx_q_aggregate(struct rp_conn* conn, const linkaddr_t* nexthop);
+static void agg_timer_cb(void* ptr);
+#endif
 
 
 /*---------------------------------------------------------------------------*/
@@ -56,14 +119,44 @@ static inline void flush_tpl_buf(struct rp_conn* conn);
 
 void rp_open(struct rp_conn* conn, uint16_t channels, bool sink, const struct rp_callbacks *callbacks)
 {
+#if RP_NON_STORING && !RP_SINK_IMAGE
+  if(sink){ //no parent map in this image
+    #if USR_DEBUG == 1
+    printf("rp: ERROR, router image opened as sink, build the sink with make NON_STORING=1 SINK=1\n");
+    #endif
+    return;
+  }
+#endif
   /*---INIT CONNECTION---*/
   linkaddr_copy(&conn->parent, &linkaddr_null); //init parent to null
+  linkaddr_copy(&conn->backup, &linkaddr_null);
   conn->metric = METRIC_Q124_INF;
   conn->seqn = 0;
   conn->sink = sink;
   conn->hops = 0xFF;
   conn->callbacks = callbacks;
-  conn->tpl_buf.size = 0;
+  flush_tpl_buf(conn);
+#if !RP_NON_STORING
+  conn->rpt_seq = 0;
+  conn->rpt_q_wait = false;
+#endif
+  conn->bc_suppressed = false;
+  conn->bseq = 0;
+  conn->solicit_answered = clock_time() - RP_SOLICIT_HOLDOFF;
+  conn->orphan = !sink;
+  LIST_STRUCT_INIT(conn, tx_q);
+  memb_init(&tx_q_memb);
+  conn->tx_q_len = 0;
+  conn->tx_busy = false;
+  conn->tx_in_send = false;
+  conn->tx_late = false;
+  conn->last_handle = 0;
+  conn->tx_handle = 0;
+  conn->tx_tpl = false;
+  conn->app_last = clock_time() - RP_AGG_WINDOW;
+  conn->q_load = 0;
+  conn->cong = 0;
+  trickle_timer_config(&conn->beacon_tt, BEACON_TRICKLE_IMIN, BEACON_TRICKLE_IMAX, BEACON_TRICKLE_K);
   //cleanup callback args
   conn->clu_args.conn = conn; conn->clu_args.nbr_tbl = nbr_tbl;
   /*---Open RIME primitives*/
@@ -74,13 +167,18 @@ void rp_open(struct rp_conn* conn, uint16_t channels, bool sink, const struct rp
   if(conn->sink){
     conn->metric=0;
     conn->hops=0;
-    ctimer_set(&conn->beacon_timer, CLOCK_SECOND, beacon_timer_cb, conn); // set the sink to send a beacon at the beginning
- 
+    ctimer_set(&conn->epoch_timer, CLOCK_SECOND, epoch_timer_cb, conn); // set the sink to start the first epoch at the beginning
+#if RP_NON_STORING && RP_SINK_IMAGE
+    ctimer_set(&par_map_timer, RP_PAR_MAP_SWEEP, par_map_timer_cb, conn);
+#endif
   }
-  nbr_table_register(nbr_tbl, NULL);
+  nbr_table_register(nbr_tbl, par_cand_removed);
+  par_cand_init();
+  dsc_tbl_init();
 
-  /* Schedule the first cleanup */ 
-  ctimer_set(&nbr_tbl_cleanup_timer, NBR_TBL_CLEANUP_INTERVAL, nbr_tbl_cleanup_cb, &conn->clu_args);
+  /* the first cleanup is scheduled with the first neighbor */
+  ctimer_stop(&conn->nbr_tbl_cleanup_timer);
+  solicit_start(conn); //ask the neighbors for beacons instead of waiting for the next one
   #if USR_DEBUG == 1
   printf("Node %02x:%02x is initializing rp connection\n",linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1]);
   #endif
@@ -89,35 +187,460 @@ void rp_open(struct rp_conn* conn, uint16_t channels, bool sink, const struct rp
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
-//flushes the report buffer
+/*--------------------------------WIRE FORMAT--------------------------------*/
+/* Unicast headers and beacons are written and parsed only here: with RP_HDR_COMPRESSION
+   they are compressed with 1-byte node IDs (see rp.h), otherwise the structs are sent as they are */
+
+//prepend the unicast header to the packetbuf, followed by tlv_len bytes of TLVs. Returns false if it does not fit
+static bool uc_hdr_push(const struct uc_hdr* hdr, const uint8_t* tlv, uint8_t tlv_len){
+  uint8_t buf[UC_HDR_MAX_LEN];
+  uint8_t len;
+#if RP_HDR_COMPRESSION
+  linkaddr_t addr;
+  bool elide = linkaddr_cmp(&hdr->s_addr, &linkaddr_node_addr); //this node is the link layer sender
+  //the real type goes in the extension byte
+  uint8_t type = (tlv_len > 0 || hdr->type >= UC_TYPE_EXT) ? UC_TYPE_EXT : hdr->type;
+  buf[0] = (type << UC_HC_TYPE_SHIFT) | (elide ? UC_HC_SRC_ELIDED : 0) | (hdr->hops & UC_HC_HOPS_MASK);
+  len = 1;
+  if(type == UC_TYPE_EXT) buf[len++] = hdr->type | ((tlv_len > 0) ? UC_EXT_TLV : 0);
+  if(!UC_TYPE_HOP_LOCAL(hdr->type)){
+    addr = hdr->d_addr;
+    if(!UC_TYPE_TO_SINK(hdr->type)) len += short_id_write(buf + len, &addr);
+    if(!elide){
+      addr = hdr->s_addr;
+      len += short_id_write(buf + len, &addr);
+    }
+    buf[len++] = hdr->rank >> 8;
+    buf[len++] = hdr->rank & 0xFF;
+  }
+#else
+  memcpy(buf, hdr, sizeof(struct uc_hdr));
+  if(tlv_len > 0) buf[0] |= UC_EXT_TLV;
+  len = sizeof(struct uc_hdr);
+#endif
+  if(tlv_len > 0){
+    if(tlv_len > RP_TLV_MAX_LEN) return false;
+    buf[len++] = tlv_len;
+    memcpy(buf + len, tlv, tlv_len);
+    len += tlv_len;
+  }
+  if(!packetbuf_hdralloc(len)) return false;
+  memcpy(packetbuf_hdrptr(), buf, len);
+  return true;
+}
+
+/*---------------------------------------------------------------------------*/
+//parse and strip the unicast header of a received frame. The TLVs (at most RP_TLV_MAX_LEN bytes)
+//are copied into tlv. Returns false if it is malformed
+static bool uc_hdr_pull(struct uc_hdr* hdr, const linkaddr_t* tx_addr, uint8_t* tlv, uint8_t* tlv_len){
+  const uint8_t* p = packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+  uint8_t used, ext = 0;
+#if RP_HDR_COMPRESSION
+  if(len < 1) return false;
+  uint8_t n;
+  linkaddr_t addr;
+  used = 1;
+  hdr->type = p[0] >> UC_HC_TYPE_SHIFT;
+  hdr->hops = p[0] & UC_HC_HOPS_MASK;
+  if(hdr->type == UC_TYPE_EXT){
+    if(len < 2) return false;
+    ext = p[used++];
+    hdr->type = ext & UC_EXT_TYPE_MASK;
+  }
+  if(UC_TYPE_HOP_LOCAL(hdr->type)){ //from a child or the parent to this node
+    hdr->s_addr = *tx_addr;
+    hdr->d_addr = linkaddr_node_addr;
+  }
+  else{
+    if(UC_TYPE_TO_SINK(hdr->type))
+      hdr->d_addr = linkaddr_null;
+    else{
+      if((n = short_id_read(p + used, len - used, &addr)) == 0) return false;
+      hdr->d_addr = addr;
+      used += n;
+    }
+    if(p[0] & UC_HC_SRC_ELIDED)
+      hdr->s_addr = *tx_addr;
+    else{
+      if((n = short_id_read(p + used, len - used, &addr)) == 0) return false;
+      hdr->s_addr = addr;
+      used += n;
+    }
+    if(len < used + 2) return false;
+    hdr->rank = ((uint16_t)p[used] << 8) | p[used + 1];
+    used += 2;
+  }
+#else
+  if(len < sizeof(struct uc_hdr)) return false;
+  memcpy(hdr, p, sizeof(struct uc_hdr));
+  ext = hdr->type;
+  hdr->type &= UC_EXT_TYPE_MASK;
+  used = sizeof(struct uc_hdr);
+#endif
+  *tlv_len = 0;
+  if(ext & UC_EXT_TLV){
+    if(len < used + 1 || p[used] > RP_TLV_MAX_LEN || len < used + 1 + p[used]) return false;
+    *tlv_len = p[used];
+    memcpy(tlv, p + used + 1, *tlv_len);
+    used += 1 + *tlv_len;
+  }
+  packetbuf_hdrreduce(used);
+  return true;
+}
+
+/*---------------------------------------------------------------------------*/
+//rank field of a routed frame sent to nexthop: this node's rank, the direction, and the rank
+//error flag of the frame being forwarded
+static void uc_hdr_rank(const struct rp_conn* conn, struct uc_hdr* hdr, const linkaddr_t* nexthop){
+  uint16_t rank = (conn->metric > UC_RANK_MASK) ? UC_RANK_MASK : conn->metric;
+  hdr->rank = rank | (hdr->rank & UC_RANK_ERR) | (linkaddr_cmp(nexthop, &conn->parent) ? 0 : UC_RANK_DOWN);
+}
+
+/*---------------------------------------------------------------------------*/
+//loop detection on a frame to be forwarded (see UC_RANK_ERR). Returns false if it must be dropped
+static bool rank_check(struct rp_conn* conn, struct uc_hdr* hdr){
+  uint16_t rank = (conn->metric > UC_RANK_MASK) ? UC_RANK_MASK : conn->metric;
+  if((hdr->rank & UC_RANK_DOWN) || (hdr->rank & UC_RANK_MASK) > rank) return true; //consistent
+  #if USR_DEBUG == 1
+  printf("rp: rank error on a frame from %02x:%02x (rank %u, mine %u)%s\n", hdr->s_addr.u8[0], hdr->s_addr.u8[1],
+         hdr->rank & UC_RANK_MASK, rank, (hdr->rank & UC_RANK_ERR) ? ", dropping" : "");
+  #endif
+  beacon_reset(conn); //advertise the current rank of this node
+  if(hdr->rank & UC_RANK_ERR) return false;
+  hdr->rank |= UC_RANK_ERR;
+  return true;
+}
+
+/*---------------------------------------------------------------------------*/
+//value of the first TLV of the given type (NULL if there is none), *len is set to its length
+static const uint8_t* tlv_find(const uint8_t* tlv, uint8_t tlv_len, uint8_t type, uint8_t* len){
+  uint16_t off = 0;
+  while(off + TLV_HDR_LEN <= tlv_len){
+    uint8_t l = tlv[off + 1];
+    if(off + TLV_HDR_LEN + l > tlv_len) return NULL; //truncated
+    if(tlv[off] == type){
+      *len = l;
+      return tlv + off + TLV_HDR_LEN;
+    }
+    off += TLV_HDR_LEN + l; //skip unknown types
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*/
+//write the beacon into the (cleared) packetbuf, followed by tlv_len bytes of TLVs
+static void bc_msg_write(const struct bc_msg* msg, const uint8_t* tlv, uint8_t tlv_len){
+  uint8_t* p = packetbuf_dataptr();
+  uint16_t len;
+#if RP_HDR_COMPRESSION
+  linkaddr_t parent = msg->parent;
+  memcpy(p, msg, BC_HC_FIXED_LEN); //seqn, metric, hops and bseq are the first fields of the struct
+  len = BC_HC_FIXED_LEN + short_id_write(p + BC_HC_FIXED_LEN, &parent);
+#else
+  memcpy(p, msg, sizeof(struct bc_msg));
+  len = sizeof(struct bc_msg);
+#endif
+  memcpy(p + len, tlv, tlv_len);
+  packetbuf_set_datalen(len + tlv_len);
+}
+
+/*---------------------------------------------------------------------------*/
+//parse the beacon in the packetbuf. The TLVs that follow the beacon fields (at most RP_TLV_MAX_LEN bytes)
+//are copied into tlv. Returns false if it is malformed
+static bool bc_msg_read(struct bc_msg* msg, uint8_t* tlv, uint8_t* tlv_len){
+  const uint8_t* p = packetbuf_dataptr();
+  uint16_t len = packetbuf_datalen();
+  uint16_t used;
+#if RP_HDR_COMPRESSION
+  linkaddr_t parent;
+  uint8_t n;
+  if(len <= BC_HC_FIXED_LEN) return false;
+  if((n = short_id_read(p + BC_HC_FIXED_LEN, len - BC_HC_FIXED_LEN, &parent)) == 0) return false;
+  memcpy(msg, p, BC_HC_FIXED_LEN);
+  msg->parent = parent;
+  used = BC_HC_FIXED_LEN + n;
+#else
+  if(len < sizeof(struct bc_msg)) return false;
+  memcpy(msg, p, sizeof(struct bc_msg));
+  used = sizeof(struct bc_msg);
+#endif
+  if(len - used > RP_TLV_MAX_LEN) return false;
+  *tlv_len = len - used;
+  memcpy(tlv, p + used, *tlv_len);
+  return true;
+}
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+/*------------------------------TRANSMIT QUEUE-------------------------------*/
+/* Unicast frames are not sent straight from the packetbuf: they are copied in a queuebuf
+   together with their own next hop, and sent one at a time. uc_sent() always refers to
+   the head of the queue, so ACKs and ETX are attributed to the right neighbor.
+   With RP_AGG a data frame is appended to a queued data frame for the same next hop
+   when it fits. Only a local packet of the application that follows another one by less than
+   RP_AGG_WINDOW (a burst, more are likely to come) waits at the head of the queue for the rest
+   of its window: forwarded and control frames are never delayed.
+   A frame carries the handles of the application packets in it (rp_send): when it leaves
+   the queue, the sent callback reports each of them. A MAC result that comes before
+   unicast_send() returns (the frame was refused) is handled from a timer, so the callback
+   never runs inside rp_send, before the caller has the handle */
+
+uint8_t rp_tx_queue_len(const struct rp_conn* conn){
+  return conn->tx_q_len;
+}
+
+/*---------------------------------------------------------------------------*/
+//enqueue the frame in the packetbuf and start the transmission. Returns 1 if queued, 0 if the queue is full
+static int tx_q_push(struct rp_conn* conn, const linkaddr_t* nexthop, uint8_t type){
+  int ret = tx_q_enqueue(conn, nexthop, type);
+  if(ret && !conn->tx_busy) tx_q_send_next(conn);
+  return ret;
+}
+
+/*---------------------------------------------------------------------------*/
+//enqueue the frame in the packetbuf without starting the transmission (to queue a burst)
+static int tx_q_enqueue(struct rp_conn* conn, const linkaddr_t* nexthop, uint8_t type){
+#if RP_AGG
+  if(type == UC_TYPE_DATA && tx_q_aggregate(conn, nexthop)) return 1;
+#endif
+  struct rp_tx_item* it = memb_alloc(&tx_q_memb);
+  if(it == NULL){
+    #if USR_DEBUG == 1
+    printf("rp: transmit queue full (%u frames), dropping packet to %02x:%02x\n", conn->tx_q_len, nexthop->u8[0], nexthop->u8[1]);
+    #endif
+    cong_update(conn, true);
+    return 0;
+  }
+  it->qb = queuebuf_new_from_packetbuf();
+  if(it->qb == NULL){
+    memb_free(&tx_q_memb, it);
+    #if USR_DEBUG == 1
+    printf("rp: no queuebuf left (%u frames), dropping packet to %02x:%02x\n", conn->tx_q_len, nexthop->u8[0], nexthop->u8[1]);
+    #endif
+    cong_update(conn, true);
+    return 0;
+  }
+  it->nexthop = *nexthop;
+  it->type = type;
+  it->retx = 0;
+  it->burst = false;
+  it->hold = false;
+  it->tpl = conn->tx_tpl;
+  it->enq_time = clock_time();
+  it->num_tx = 0;
+  it->n_handles = 0;
+  if(conn->tx_handle != 0){ //a packet of the application
+    it->handle[0] = conn->tx_handle;
+    it->handle_time[0] = it->enq_time;
+    it->n_handles = 1;
+#if RP_AGG
+    it->hold = it->enq_time - conn->app_last < RP_AGG_WINDOW;
+#endif
+  }
+  list_add(conn->tx_q, it);
+  conn->tx_q_len++;
+  cong_update(conn, false);
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*/
+//remove the head of the queue, status is the MAC status of its last attempt. The packets
+//of the application in it are reported after the removal: the callback may queue new ones
+static void tx_q_pop(struct rp_conn* conn, int status){
+  struct rp_tx_item* it = list_pop(conn->tx_q);
+  if(it == NULL) return;
+  uint16_t handle[RP_TX_HANDLES];
+  clock_time_t handle_time[RP_TX_HANDLES];
+  uint8_t n = it->n_handles;
+  uint8_t num_tx = it->num_tx;
+#if !RP_NON_STORING
+  if(it->tpl && status != MAC_TX_OK) rpt_frag_lost(conn); //the parent did not get the report fragment
+  if(conn->rpt_q_wait){ //a report burst waits for this slot
+    conn->rpt_q_wait = false;
+    ctimer_set(&subtree_report_timer, 0, subtree_report_cb, conn);
+  }
+#endif
+  memcpy(handle, it->handle, n * sizeof(handle[0]));
+  memcpy(handle_time, it->handle_time, n * sizeof(handle_time[0]));
+  queuebuf_free(it->qb);
+  memb_free(&tx_q_memb, it);
+  conn->tx_q_len--;
+  cong_update(conn, false);
+
+  if(conn->callbacks->sent == NULL) return;
+  clock_time_t now = clock_time();
+  uint8_t i;
+  for(i = 0; i < n; i++)
+    conn->callbacks->sent(handle[i], status, num_tx, now - handle_time[i]);
+}
+
+/*---------------------------------------------------------------------------*/
+//transmit the head of the queue. The result comes back in uc_sent()
+static void tx_q_send_next(struct rp_conn* conn){
+  struct rp_tx_item* it = list_head(conn->tx_q);
+  if(it == NULL) return;
+#if RP_AGG
+  clock_time_t held = clock_time() - it->enq_time;
+  if(it->hold && it->retx == 0 && !it->burst && held < RP_AGG_WINDOW){ //wait for more frames to the same next hop
+    ctimer_set(&conn->agg_timer, RP_AGG_WINDOW - held, agg_timer_cb, conn);
+    return;
+  }
+#endif
+  queuebuf_to_packetbuf(it->qb);
+#if RP_BURST
+  struct rp_tx_item* nx = list_item_next(it);
+  bool pending = nx != NULL && linkaddr_cmp(&nx->nexthop, &it->nexthop);
+  packetbuf_set_attr(PACKETBUF_ATTR_PENDING, pending); //keep the receiver awake for the next one
+  if(pending) nx->burst = true;
+#endif
+  conn->tx_busy = true;
+  conn->tx_in_send = true;
+  if(!unicast_send(&conn->uc, &it->nexthop) && !conn->tx_late) //could not be handed to the MAC
+    tx_late_set(conn, MAC_TX_ERR_FATAL, 0);
+  conn->tx_in_send = false;
+}
+
+/*---------------------------------------------------------------------------*/
+//the frame in flight is over before unicast_send() returned (refused, or reported at once by the MAC):
+//handle it from a timer, so that the sent callback never runs inside rp_send
+static void tx_late_set(struct rp_conn* conn, int status, int num_tx){
+  conn->tx_late = true;
+  conn->tx_late_status = status;
+  conn->tx_late_num_tx = num_tx;
+  ctimer_set(&conn->tx_late_timer, 0, tx_late_cb, conn);
+}
+
+static void tx_late_cb(void* ptr){
+  struct rp_conn* conn = (struct rp_conn*)ptr;
+  conn->tx_late = false;
+  uc_sent(&conn->uc, conn->tx_late_status, conn->tx_late_num_tx);
+}
+
+/*---------------------------------------------------------------------------*/
+//new sample of the queue occupancy (drop: a frame found the queue full). Updates the
+//advertised congestion level, with hysteresis
+static void cong_update(struct rp_conn* conn, bool drop){
+  uint16_t occ = drop ? 256 : ((uint16_t)conn->tx_q_len << 8) / RP_TX_QUEUE_SIZE;
+  uint8_t old = conn->cong;
+  conn->q_load = (3 * conn->q_load + occ) >> 2;
+  while(conn->cong < CONG_LEVEL_MAX && conn->q_load >= RP_CONG_STEP * (conn->cong + 1) + RP_CONG_HYST)
+    conn->cong++;
+  while(conn->cong > 0 && conn->q_load + RP_CONG_HYST < RP_CONG_STEP * conn->cong)
+    conn->cong--;
+  if(conn->cong == old) return;
+  #if USR_DEBUG == 1
+  printf("rp: congestion level %u (queue load %u/256)\n", conn->cong, conn->q_load);
+  #endif
+  if(old == CONG_LEVEL_MAX || conn->cong == CONG_LEVEL_MAX)
+    beacon_reset(conn); //the children have to know soon that this node is (no longer) saturated
+}
+
+/*---------------------------------------------------------------------------*/
+//the parent advertised the maximum congestion level
+static bool parent_saturated(const struct rp_conn* conn){
+  const entry_t* e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &conn->parent);
+  return e != NULL && e->cong == CONG_LEVEL_MAX;
+}
+
+#if RP_AGG
+/*---------------------------------------------------------------------------*/
+//append the data frame in the packetbuf to a queued data frame for the same next hop.
+//Returns false if there is none with enough room (the frame in flight is never touched)
+static bool tx_q_aggregate(struct rp_conn* conn, const linkaddr_t* nexthop){
+  uint8_t frame[RP_AGG_MAX_LEN];
+  uint8_t agg[RP_AGG_MAX_LEN];
+  uint16_t len = packetbuf_totlen();
+  struct rp_tx_item* it;
+  for(it = list_head(conn->tx_q); it != NULL; it = list_item_next(it)){
+    if((conn->tx_busy && it == list_head(conn->tx_q)) || (it->type != UC_TYPE_DATA && it->type != UC_TYPE_AGG)
+       || !linkaddr_cmp(&it->nexthop, nexthop)) continue;
+    if(conn->tx_handle != 0 && it->n_handles == RP_TX_HANDLES) continue; //no room for the handle
+    uint16_t q_len = queuebuf_datalen(it->qb);
+    uint16_t agg_len = (it->type == UC_TYPE_AGG) ? q_len + 1 + len : 1 + 1 + q_len + 1 + len;
+    if(agg_len > RP_AGG_MAX_LEN) continue;
+
+    packetbuf_copyto(frame); //header and payload of the new frame
+    uint16_t off = 0;
+    if(it->type == UC_TYPE_DATA){ //first merge: the queued frame becomes the first record
+      agg[off++] = UC_AGG_HDR;
+      agg[off++] = (uint8_t)q_len;
+    }
+    memcpy(agg + off, queuebuf_dataptr(it->qb), q_len);
+    off += q_len;
+    agg[off++] = (uint8_t)len;
+    memcpy(agg + off, frame, len);
+
+    packetbuf_copyfrom(agg, agg_len);
+    queuebuf_update_from_packetbuf(it->qb);
+    it->type = UC_TYPE_AGG;
+    it->tpl |= conn->tx_tpl;
+    if(conn->tx_handle != 0){
+      it->handle[it->n_handles] = conn->tx_handle;
+      it->handle_time[it->n_handles] = clock_time();
+      it->n_handles++;
+    }
+    #if USR_DEBUG == 1
+    printf("rp: aggregated frame to %02x:%02x, %u bytes\n", nexthop->u8[0], nexthop->u8[1], agg_len);
+    #endif
+    return true;
+  }
+  return false;
+}
+
+/*---------------------------------------------------------------------------*/
+//the aggregation window of the head of the queue is over
+static void agg_timer_cb(void* ptr){
+  struct rp_conn* conn = (struct rp_conn*)ptr;
+  if(!conn->tx_busy) tx_q_send_next(conn);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------------------------------------------------*/
+//flushes the report buffer, with the fragments in flight
 static inline void flush_tpl_buf(struct rp_conn* conn){
+#if !RP_NON_STORING
   conn->tpl_buf.size = 0;
+  conn->buf_off = 0;
+  conn->sent_off = 0;
+  conn->rpt_cnt = 0;
+  conn->rpt_frag = 0;
+  conn->rpt_sync = false;
+  conn->rpt_retx = 0;
+  ctimer_stop(&conn->rpt_timer);
+#endif
 }
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
- /* Resets the connection status for.
-  This function updates the neighbor table by setting the age of descendants
-  to an invalid value, downgrading any children or parent nodes to neighbors,
+ /* Resets the connection status for a new epoch (new beacon seqn).
+  With RP_INCREMENTAL_EPOCH the routing state is kept: parent, children and descendants
+  that are still valid survive the seqn bump, only the expired entries are removed by the
+  cleanup, and the parent is re-evaluated on the beacons of the new epoch.
+  Otherwise, this function flushes the descendant table, downgrading any children or parent nodes to neighbors,
   and then resets the local connection state. Then flushes the topology
   report buffer and performs a cleanup of the neighbor table. */
 
 static void reset_connection_status(struct rp_conn* conn, uint16_t seqn, bool sink){
+#if RP_INCREMENTAL_EPOCH
+    conn->seqn = seqn;
+    nbr_tbl_cleanup_cb(&conn->clu_args); //revalidate: drop only the stale entries
+#else
+    dsc_tbl_flush(); //remove all the descendants
     entry_t* e = nbr_table_head(nbr_tbl);
     while(e != NULL){ 
-        if(e->type == NODE_DESCENDANT) //set descendants to be removed from the neighbor table
-            e->age = ALWAYS_INVALID_AGE;
-        else if(e->type == NODE_CHILD || e->type == NODE_PARENT) //downgrade the parent and the childs to neighbors
-            e->type = NODE_NEIGHBOR;
+        if(e->type == NODE_CHILD || e->type == NODE_PARENT) //downgrade the parent and the childs to neighbors
+            nbr_entry_set_type(nbr_tbl, e, NODE_NEIGHBOR);
         e = nbr_table_next(nbr_tbl, e);
     }
     //local state reset
     linkaddr_copy(&conn->parent, &linkaddr_null);
+    linkaddr_copy(&conn->backup, &linkaddr_null);
     conn->metric = sink ? 0 :  METRIC_Q124_INF;
     conn->seqn = seqn;
     flush_tpl_buf(conn);
-    ctimer_set(&nbr_tbl_cleanup_timer, NBR_TBL_CLEANUP_INTERVAL, nbr_tbl_cleanup_cb, &conn->clu_args);
-    nbr_tbl_cleanup_cb(&conn->clu_args);
-    
+    nbr_tbl_cleanup_cb(&conn->clu_args); //also reschedules the next one
+#endif
 }
 
 /*---------------------------------------------------------------------------*/
@@ -125,17 +648,40 @@ static void reset_connection_status(struct rp_conn* conn, uint16_t seqn, bool si
 /*----------------------------Any-To-Any handling----------------------------*/
 
 
-//called only by the application
-int rp_send(struct rp_conn *conn, const linkaddr_t *dst_addr){
+//routes and queues a packet of the application (rp_send)
+static int data_send(struct rp_conn *conn, const linkaddr_t *dst_addr){
+
+    if(neg_cache_hit(dst_addr)) return -1; //reported unreachable, fail fast
 
     linkaddr_t nexthop;
-    nbr_tbl_lookup(nbr_tbl, &nexthop, dst_addr, &conn->parent);
+    nbr_tbl_lookup(nbr_tbl, &nexthop, dst_addr, &conn->parent, &linkaddr_node_addr);
 
     if(!conn->sink && linkaddr_cmp(&conn->parent, &linkaddr_null)) return -1; //if the node is not connected return an error
+#if !RP_NON_STORING
+    if(linkaddr_cmp(&nexthop, &linkaddr_null)) return -1; //the sink has no route
+#endif
+    //backpressure: the parent is saturated, do not pile up local packets for it
+    if(linkaddr_cmp(&nexthop, &conn->parent) && parent_saturated(conn) && conn->tx_q_len >= RP_CONG_ADMIT){
+      #if USR_DEBUG == 1
+      printf("rp: parent %02x:%02x saturated, packet refused\n", conn->parent.u8[0], conn->parent.u8[1]);
+      #endif
+      return 0;
+    }
   
-    if(packetbuf_hdralloc(sizeof(struct uc_hdr))){ //insert the header into the packet buffer
-      struct uc_hdr hdr = {.s_addr=linkaddr_node_addr, .d_addr = *dst_addr, .hops=0, .type = UC_TYPE_DATA}; //init header
-      memcpy(packetbuf_hdrptr(), &hdr, sizeof(hdr));
+    struct uc_hdr hdr = {.s_addr=linkaddr_node_addr, .d_addr = *dst_addr, .hops=0, .type = UC_TYPE_DATA}; //init header
+#if RP_NON_STORING
+    if(conn->sink) return sr_send(conn, hdr);
+    uint8_t* tlv = NULL;
+    uint8_t tlv_len = 0;
+#else
+    uint8_t tlv[RP_TLV_MAX_LEN];
+    uint8_t tlv_len = linkaddr_cmp(&nexthop, &conn->parent) ? tpl_piggyback(conn, tlv, uc_tlv_room())
+                                                            : rpt_ack_piggyback(&nexthop, tlv, uc_tlv_room());
+    conn->tx_tpl = tlv_len > 0 && linkaddr_cmp(&nexthop, &conn->parent);
+#endif
+    uc_hdr_rank(conn, &hdr, &nexthop);
+    int ret = -2;
+    if(uc_hdr_push(&hdr, tlv, tlv_len)){ //insert the header into the packet buffer
       #if USR_DEBUG == 1
       printf("[LOG] Node %02x:%02x is SENDING packet to %02x:%02x via next-hop %02x:%02x\n",
         linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1],
@@ -143,21 +689,91 @@ int rp_send(struct rp_conn *conn, const linkaddr_t *dst_addr){
         nexthop.u8[0], nexthop.u8[1]);
       rp_print_routing_table(conn);
       #endif
-      //keep track of the last unicast. Used for uc_recv for etx computation
-      conn->last_uc_daddr = nexthop;
-      return unicast_send(&conn->uc, &nexthop);
+      ret = tx_q_push(conn, &nexthop, UC_TYPE_DATA);
     }
-    else return -2;
+#if !RP_NON_STORING
+    if(conn->tx_tpl && ret <= 0) rpt_frag_lost(conn); //the piggybacked fragment was not queued
+    conn->tx_tpl = false;
+#endif
+    return ret;
+  }
+
+  /*---------------------------------------------------------------------------*/
+  //called only by the application
+  int rp_send(struct rp_conn *conn, const linkaddr_t *dst_addr){
+    //the handle is taken before queuing: the queue item records it
+    uint16_t handle = (conn->last_handle % RP_HANDLE_MAX) + 1;
+    conn->last_handle = handle;
+    conn->tx_handle = handle;
+    int ret = data_send(conn, dst_addr);
+    conn->tx_handle = 0;
+    if(ret > 0) conn->app_last = clock_time();
+    return (ret > 0) ? (int)handle : ret;
   }
     
   /*---------------------------------------------------------------------------*/
-  //called when the data have to be forwarded
-  static int forward_data(struct rp_conn* conn, struct uc_hdr hdr){
-    if(packetbuf_hdralloc(sizeof(struct uc_hdr))) //restore the header into the packet buffer
-      memcpy(packetbuf_hdrptr(), &hdr, sizeof(hdr));
-  
+  //the packet from src to dst cannot be routed from here: drop it and tell src
+  static void rerr_send(struct rp_conn* conn, const linkaddr_t* src, const linkaddr_t* dst){
+    #if USR_DEBUG == 1
+    printf("rp: no route to %02x:%02x, route error to %02x:%02x\n", dst->u8[0], dst->u8[1], src->u8[0], src->u8[1]);
+    #endif
+    if(linkaddr_cmp(src, &linkaddr_node_addr)){
+      neg_cache_add(dst);
+      return;
+    }
+    packetbuf_clear();
+    packetbuf_set_datalen(short_id_write(packetbuf_dataptr(), dst));
+    struct uc_hdr hdr = {.s_addr = linkaddr_node_addr, .d_addr = *src, .hops = 0, .type = UC_TYPE_RERR};
+#if RP_NON_STORING
+    if(conn->sink){
+      sr_send(conn, hdr);
+      return;
+    }
+#endif
     linkaddr_t nexthop;
-    nbr_tbl_lookup(nbr_tbl, &nexthop, &hdr.d_addr, &conn->parent);
+    nbr_tbl_lookup(nbr_tbl, &nexthop, src, &conn->parent, &linkaddr_node_addr);
+    uc_hdr_rank(conn, &hdr, &nexthop);
+    if(!linkaddr_cmp(&nexthop, &linkaddr_null) && uc_hdr_push(&hdr, NULL, 0))
+      tx_q_push(conn, &nexthop, UC_TYPE_DATA);
+  }
+
+  /*---------------------------------------------------------------------------*/
+  //called when the data have to be forwarded. tx_addr is the previous hop
+  static int forward_data(struct rp_conn* conn, struct uc_hdr hdr, const linkaddr_t* tx_addr){
+    linkaddr_t nexthop;
+    linkaddr_t dst = hdr.d_addr;
+    nbr_tbl_lookup(nbr_tbl, &nexthop, &dst, &conn->parent, tx_addr);
+
+#if RP_NON_STORING
+    if(conn->sink){ //down with a source route
+      int ret = sr_send(conn, hdr);
+      if(ret == -1 && hdr.type != UC_TYPE_RERR) rerr_send(conn, &hdr.s_addr, &hdr.d_addr);
+      return ret;
+    }
+#endif
+    //no route: this is the sink, or the packet came down from the parent and would go back up
+    if(linkaddr_cmp(&nexthop, &linkaddr_null) ||
+       (linkaddr_cmp(&nexthop, &conn->parent) && linkaddr_cmp(tx_addr, &conn->parent))){
+      if(hdr.type != UC_TYPE_RERR) rerr_send(conn, &hdr.s_addr, &hdr.d_addr);
+      return -1;
+    }
+
+    uc_hdr_rank(conn, &hdr, &nexthop);
+#if RP_NON_STORING
+    if(!uc_hdr_push(&hdr, NULL, 0)) return -2; //restore the header into the packet buffer
+#else
+    //the TLVs of the received frame are not forwarded: upwards, carry this node's pending topology changes,
+    //downwards the report ack owed to the next hop
+    uint8_t tlv[RP_TLV_MAX_LEN];
+    uint8_t tlv_len = linkaddr_cmp(&nexthop, &conn->parent) ? tpl_piggyback(conn, tlv, uc_tlv_room())
+                                                            : rpt_ack_piggyback(&nexthop, tlv, uc_tlv_room());
+    conn->tx_tpl = tlv_len > 0 && linkaddr_cmp(&nexthop, &conn->parent);
+    if(!uc_hdr_push(&hdr, tlv, tlv_len)){ //restore the header into the packet buffer
+      if(conn->tx_tpl) rpt_frag_lost(conn);
+      conn->tx_tpl = false;
+      return -2;
+    }
+#endif
   
     #if USR_DEBUG == 1
     printf("[LOG] Node %02x:%02x is FORWARDING packet from %02x:%02x to destination %02x:%02x via next-hop %02x:%02x\n",
@@ -167,9 +783,14 @@ int rp_send(struct rp_conn *conn, const linkaddr_t *dst_addr){
       nexthop.u8[0], nexthop.u8[1]);
     rp_print_routing_table(conn);
     #endif
-    //keep track of the last unicast. Used for uc_recv for etx computation
-    conn->last_uc_daddr = nexthop;
-    return unicast_send(&conn->uc, &nexthop);
+#if RP_NON_STORING
+    return tx_q_push(conn, &nexthop, UC_TYPE_DATA);
+#else
+    int ret = tx_q_push(conn, &nexthop, UC_TYPE_DATA);
+    if(conn->tx_tpl && ret <= 0) rpt_frag_lost(conn); //the piggybacked fragment was not queued
+    conn->tx_tpl = false;
+    return ret;
+#endif
   }  
   
 
@@ -180,38 +801,136 @@ int rp_send(struct rp_conn *conn, const linkaddr_t *dst_addr){
 /*---------------------------------------------------------------------------*/
 /*------------------------------BEACON HANDLING------------------------------*/
 
-static void beacon_timer_cb(void* ptr){
+/* (re)start the beacon trickle from the minimum interval: the routing state changed */
+static void beacon_reset(struct rp_conn* conn){
+    if(!trickle_timer_is_running(&conn->beacon_tt))
+        trickle_timer_set(&conn->beacon_tt, beacon_timer_cb, conn);
+    trickle_timer_inconsistency(&conn->beacon_tt);
+}
+
+/*---------------------------------------------------------------------------*/
+/* orphan node: start soliciting beacons (see BC_SOLICIT) */
+static void solicit_start(struct rp_conn* conn){
+    if(conn->sink || !ctimer_expired(&conn->solicit_timer)) return; //already soliciting
+    conn->solicit_int = RP_SOLICIT_IMIN;
+    ctimer_set(&conn->solicit_timer, 1 + random_rand() % RP_SOLICIT_IMIN, solicit_timer_cb, conn);
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void solicit_timer_cb(void* ptr){
     struct rp_conn* conn = (struct rp_conn*)ptr;
-  
+    if(!linkaddr_cmp(&conn->parent, &linkaddr_null)) return; //joined meanwhile
+
+    packetbuf_clear();
+    *(uint8_t*)packetbuf_dataptr() = BC_SOLICIT;
+    packetbuf_set_datalen(BC_SOLICIT_LEN);
+    broadcast_send(&conn->bc);
+    #if USR_DEBUG == 1
+    printf("rp: no parent, soliciting beacons (next in %lu ticks at most)\n", (unsigned long)conn->solicit_int);
+    #endif
+
+    //exponential backoff, random in the second half of the interval
+    ctimer_set(&conn->solicit_timer, conn->solicit_int / 2 + random_rand() % (conn->solicit_int / 2 + 1), solicit_timer_cb, conn);
+    conn->solicit_int = (conn->solicit_int >= RP_SOLICIT_IMAX / 2) ? RP_SOLICIT_IMAX : conn->solicit_int * 2;
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void epoch_timer_cb(void* ptr){
+    struct rp_conn* conn = (struct rp_conn*)ptr;
+
     /*SINK LOGIC*/
-    if(conn->sink){
-      conn->seqn++; 
-      reset_connection_status(conn, conn->seqn, conn->sink); //start a new epooch
-      ctimer_set(&conn->beacon_timer, TREE_BEACON_INTERVAL, beacon_timer_cb, conn); //schedule the next flood
+    conn->seqn++; 
+    reset_connection_status(conn, conn->seqn, conn->sink); //start a new epooch
+    beacon_reset(conn); //flood the new seqn
+    ctimer_set(&conn->epoch_timer, TREE_EPOCH_INTERVAL, epoch_timer_cb, conn); //schedule the next epoch
+}
+
+/*---------------------------------------------------------------------------*/
+
+static void beacon_timer_cb(void* ptr, uint8_t suppress){
+    struct rp_conn* conn = (struct rp_conn*)ptr;
+
+    if(!conn->sink && linkaddr_cmp(&conn->parent, &linkaddr_null)) return; //nothing to advertise
+
+    /*Suppress the beacon if enough neighbors advertised the same state, but never twice in a row
+    nor at the maximum interval: beacons also keep this node alive in the neighbors' tables
+    (gap bound in ENTRY_EXPIRATION_TIME)*/
+    if(suppress == TRICKLE_TIMER_TX_SUPPRESS && !conn->bc_suppressed &&
+       conn->beacon_tt.i_cur < (BEACON_TRICKLE_IMIN << BEACON_TRICKLE_IMAX)){
+      conn->bc_suppressed = true;
+      return;
     }
+    conn->bc_suppressed = false;
 
     /*send beacon*/
     packetbuf_clear();
-    struct bc_msg msg = {.seqn = conn->seqn, .metric_q124 = conn->metric, .hops = conn->hops, .parent = conn->parent};
-    memcpy(packetbuf_dataptr(), &msg, sizeof(struct bc_msg));
-    packetbuf_set_datalen(sizeof(struct bc_msg));
+    struct bc_msg msg = {.seqn = conn->seqn, .metric_q124 = conn->metric, .hops = conn->hops, .bseq = ++conn->bseq, .parent = conn->parent};
+    uint8_t tlv[RP_TLV_MAX_LEN];
+    uint8_t tlv_len = 0;
+    cong_update(conn, false); //the average decays while the queue is idle
+    if(conn->cong > 0){
+      tlv[0] = TLV_CONGESTION;
+      tlv[1] = 1;
+      tlv[2] = conn->cong;
+      tlv_len = TLV_HDR_LEN + 1;
+    }
+#if LOAD_METRIC
+    if(!conn->sink){ //the sink ends every path: no load to balance
+      uint16_t dc = simple_energest_radio_dc();
+      uint16_t sub = subtree_size(nbr_tbl);
+      tlv[tlv_len] = TLV_LOAD;
+      tlv[tlv_len + 1] = 2;
+      tlv[tlv_len + 2] = (dc > 0xFF) ? 0xFF : (uint8_t)dc;
+      tlv[tlv_len + 3] = (sub > 0xFF) ? 0xFF : (uint8_t)sub;
+      tlv_len += TLV_HDR_LEN + 2;
+    }
+#endif
+#if SUBTREE_FILTER_BYTES > 0
+    if(subtree_filter_build(nbr_tbl, tlv + tlv_len + TLV_HDR_LEN)){ //leaves send no summary
+      tlv[tlv_len] = TLV_SUBTREE_FILTER;
+      tlv[tlv_len + 1] = SUBTREE_FILTER_BYTES;
+      tlv_len += TLV_HDR_LEN + SUBTREE_FILTER_BYTES;
+    }
+#endif
+#if !RP_NON_STORING
+    //pending topology changes for the parent (acked by the parent as any other report fragment)
+    tlv_len += tpl_piggyback(conn, tlv + tlv_len, RP_TLV_MAX_LEN - tlv_len);
+#endif
+    bc_msg_write(&msg, tlv, tlv_len);
     broadcast_send(&conn->bc);
 
     #if USR_DEBUG == 1
-    float m = metric_q124_to_float(conn->metric);
-    int ip = (int)m;
-    int fp = (int)((m - ip) * 100);
-    printf("rp: sending beacon: seqn %d metric %d.%02d\n", conn->seqn, ip, fp);
+    printf("rp: sending beacon: seqn %d metric %u.%02u\n", conn->seqn, METRIC_Q124_INT(conn->metric), METRIC_Q124_FRAC(conn->metric));
     #endif
 }
 
 /*---------------------------------------------------------------------------*/
 
 static void bc_recv(struct broadcast_conn* b_conn, const linkaddr_t *tx_addr) {
-  uint16_t rssi = packetbuf_attr(PACKETBUF_ATTR_RSSI); //get rssi for metric computation
+  int16_t rssi = (int16_t)packetbuf_attr(PACKETBUF_ATTR_RSSI); //get rssi for metric computation (signed dBm)
+  uint8_t lqi = (uint8_t)packetbuf_attr(PACKETBUF_ATTR_LINK_QUALITY);
   if(rssi < RSSI_LOW_THR) return; // discard beacons with too low rssi
 
-  if(packetbuf_datalen() != sizeof(struct bc_msg)) {
+  if(packetbuf_datalen() == BC_SOLICIT_LEN && *(uint8_t*)packetbuf_dataptr() == BC_SOLICIT){
+      //a neighbor without parent asks for beacons: answer if this node has a route to offer
+      struct rp_conn* s_conn = (struct rp_conn*)(((uint8_t*)b_conn) - offsetof(struct rp_conn, bc));
+      if((s_conn->sink || !linkaddr_cmp(&s_conn->parent, &linkaddr_null)) &&
+         clock_time() - s_conn->solicit_answered >= RP_SOLICIT_HOLDOFF){
+          s_conn->solicit_answered = clock_time();
+          beacon_reset(s_conn);
+          #if USR_DEBUG == 1
+          printf("rp: beacon solicited by %02x:%02x\n", tx_addr->u8[0], tx_addr->u8[1]);
+          #endif
+      }
+      return;
+  }
+
+  struct bc_msg msg; //get message from packet buffer
+  uint8_t tlv[RP_TLV_MAX_LEN];
+  uint8_t tlv_len;
+  if(!bc_msg_read(&msg, tlv, &tlv_len)) {
       #if USR_DEBUG == 1
       printf("rp: broadcast message has wrong size\n");
       #endif
@@ -220,106 +939,170 @@ static void bc_recv(struct broadcast_conn* b_conn, const linkaddr_t *tx_addr) {
 
   struct rp_conn* conn = (struct rp_conn*)(((uint8_t*)b_conn) - offsetof(struct rp_conn, bc));
 
-  struct bc_msg msg; //get message from packet buffer
-  memcpy(&msg, packetbuf_dataptr(), sizeof(struct bc_msg));
-  float flt_adv = metric_q124_to_float(msg.metric_q124);
+  //congestion and load of the transmitter: part of the path metric through it
+  uint8_t v_len;
+  const uint8_t* cong = tlv_find(tlv, tlv_len, TLV_CONGESTION, &v_len);
+  uint8_t b_cong = (cong == NULL || v_len < 1) ? 0 : (cong[0] > CONG_LEVEL_MAX) ? CONG_LEVEL_MAX : cong[0];
+  uint8_t b_load = 0;
+#if LOAD_METRIC
+  const uint8_t* load = tlv_find(tlv, tlv_len, TLV_LOAD, &v_len);
+  if(load != NULL && v_len >= 2) b_load = load_index(load[0], load[1]);
+#endif
   
   /*get (or create) entry of the transmitter*/
   entry_t* tx_e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, tx_addr);
   if(tx_e != NULL){ //if is an already known neighbor, then refresh the entry
     nbr_tbl_refresh(nbr_tbl, tx_addr);
+    link_est_beacon(&tx_e->le, msg.bseq, rssi, lqi);
     tx_e->adv_metric = msg.metric_q124;
+    tx_e->hops = msg.hops;
   }
-  else{ //otherwise, create new entry
-    tx_e = (entry_t*) nbr_table_add_lladdr(nbr_tbl, tx_addr, NBR_TABLE_REASON_ROUTE, NULL);
+  else{ //otherwise, create new entry (if it is worth a slot)
+    tx_e = nbr_tbl_admit(nbr_tbl, conn, tx_addr, path_metric(msg.metric_q124, etx_est_rssi(rssi), b_cong, b_load),
+                         linkaddr_cmp(&msg.parent, &linkaddr_node_addr));
+    if(tx_e == NULL){
+      #if USR_DEBUG == 1
+      printf("rp: nbr table full, ignoring %02x:%02x\n", tx_addr->u8[0], tx_addr->u8[1]);
+      #endif
+      return;
+    }
     tx_e->type = NODE_NEIGHBOR;
     tx_e->age = clock_time();
     tx_e->nexthop = *tx_addr;
-    tx_e->etx = etx_est_rssi(rssi);
-    tx_e->num_tx = 0;
-    tx_e->num_ack = 0;
+    link_est_init(&tx_e->le, msg.bseq, rssi, lqi);
     tx_e->adv_metric = msg.metric_q124;
+    tx_e->hops = msg.hops;
+    tx_e->cand_pos = PAR_CAND_NONE;
+#if !RP_NON_STORING
+    tx_e->rpt_valid = false; //no report sequence state yet
+    tx_e->rpt_ack = false;
+#endif
+    nbr_tbl_cleanup_arm(conn, ENTRY_EXPIRATION_TIME); //its deadline
    }
+  tx_e->cong = b_cong;
+#if LOAD_METRIC
+  tx_e->load = b_load;
+#endif
+  par_cand_update(tx_e); //the advertised metric, the link estimate and the congestion changed
+#if SUBTREE_FILTER_BYTES > 0
+  const uint8_t* filter = tlv_find(tlv, tlv_len, TLV_SUBTREE_FILTER, &v_len);
+  if(filter != NULL && v_len == SUBTREE_FILTER_BYTES)
+    memcpy(tx_e->dsc_filter, filter, SUBTREE_FILTER_BYTES); //latest summary of its subtree
+  else
+    memset(tx_e->dsc_filter, 0, SUBTREE_FILTER_BYTES);
+#endif
 
   /*For non sink nodes: if the beacon comes from a new epoch 
     reset your connection status and prepare to rebuild the tree from scratch */
-    if(!conn->sink && msg.seqn > conn->seqn)
+    if(!conn->sink && msg.seqn > conn->seqn){
         reset_connection_status(conn, msg.seqn, conn->sink);
+        beacon_reset(conn);
+    }
+    else if(msg.seqn < conn->seqn) //the transmitter is behind: advertise the new epoch soon
+        beacon_reset(conn);
 
     /*process beacon*/
     //compute metric to the sink through the transmitter
-    float new_mt = metric(flt_adv, tx_e->etx);
+    metric_q124_t new_mt = nbr_path_metric(tx_e);
 
     /*if the metric is better(with some tolerance) than the current,
     then the node becomes the new parent, otherwise it stays neighbor*/
-    float cur_mt_f = metric_q124_to_float(conn->metric);
-    if(preferred(new_mt, cur_mt_f)){
+    if(preferred(new_mt, conn->metric)){
+        bool par_switch = !linkaddr_cmp(&conn->parent, tx_addr);
+        if(par_switch){ //downgrade the old parent to neighbor
+            entry_t* old_par_e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &conn->parent);
+            if(old_par_e != NULL) nbr_entry_set_type(nbr_tbl, old_par_e, NODE_NEIGHBOR);
+        }
         //update connection state
         linkaddr_copy(&conn->parent, tx_addr);
-        conn->metric = metric_float_to_q124(new_mt);
+        conn->metric = new_mt;
         conn->hops = msg.hops + 1;
+        if(conn->orphan){ //time to (first) parent
+            conn->orphan = false;
+            ctimer_stop(&conn->solicit_timer);
+            #if RP_LOG_TREE == 1
+            printf("RP: Joined parent %02x:%02x hops %u\n", tx_addr->u8[0], tx_addr->u8[1], conn->hops);
+            #endif
+        }
 
         //update entry
-        tx_e->type = NODE_PARENT;
-        // set the timers for the beacon forwarding and for the upsrteam report
-        ctimer_set(&conn->beacon_timer, TREE_BEACON_FORWARD_DELAY, beacon_timer_cb, conn);
+        nbr_entry_set_type(nbr_tbl, tx_e, NODE_PARENT);
+        // advertise the new state quickly and set the timer for the upsrteam report
+        beacon_reset(conn);
+        if(par_switch){
+            buff_subtree(nbr_tbl, conn); //the new parent has to learn the whole subtree
+            backup_select(conn);
+        }
         ctimer_set(&subtree_report_timer, SUBTREE_REPORT_BASE_DEL(conn->hops), subtree_report_cb, conn);
         #if USR_DEBUG == 1
-        float m = metric_q124_to_float(conn->metric);
-        int ip = (int)m;
-        int fp = (int)((m - ip) * 100);
-        printf("rp: updating parent from %02x:%02x to %02x:%02x, new metric %d.%02d, new hops %u (received beacon seqn %u)\n",
+        printf("rp: updating parent from %02x:%02x to %02x:%02x, new metric %u.%02u, new hops %u (received beacon seqn %u)\n",
           conn->parent.u8[0], conn->parent.u8[1],
           tx_addr->u8[0], tx_addr->u8[1],
-          ip, fp, msg.hops + 1, msg.seqn);
+          METRIC_Q124_INT(conn->metric), METRIC_Q124_FRAC(conn->metric), msg.hops + 1, msg.seqn);
         #endif
     }
+    else if(linkaddr_cmp(tx_addr, &conn->parent)){
+        /*Beacon from the current parent: follow its metric. A significant jump (in either direction)
+        is an inconsistency for the neighbors, so advertise it quickly*/
+        if(preferred(conn->metric, new_mt))
+            beacon_reset(conn);
+        else if(msg.seqn == conn->seqn)
+            trickle_timer_consistency(&conn->beacon_tt);
+        conn->metric = new_mt;
+        if(msg.hops != 0xFF) conn->hops = msg.hops + 1;
+        parent_reeval(conn);
+    }
     else{
         /*Either the transmitter is a neighbor with a worse metric, or it is a child that is forwording its beacon.
         If it is a child, then it has to be added to the buffer if it is still advertising this node as
         a parent, otherwise it has to be removed from the buffer, because it found a better parent. */
         if(linkaddr_cmp(&msg.parent, &linkaddr_node_addr)){ //if the transmitter advertises this node as parent, then it is a child
             //update entry
-            tx_e->type = NODE_CHILD;
-            //update the buffer
-            stat_addr_t tx_stat = {.addr = *tx_addr, .status = STATUS_ADD};
-            conn->tpl_buf.stat_addr_arr[conn->tpl_buf.size++] = tx_stat;
+#if !RP_NON_STORING
+            //update the buffer, unless the child is already known
+            if(tx_e->type != NODE_CHILD)
+                tpl_buf_put(conn, tx_addr, STATUS_ADD);
+#endif
+            nbr_entry_set_type(nbr_tbl, tx_e, NODE_CHILD);
             #if USR_DEBUG == 1
-            float m = metric_q124_to_float(conn->metric);
-            int ip = (int)m;
-            int fp = (int)((m - ip) * 100);
-            printf("rp: new child %02x:%02x, my metric %d.%02d, my seqn %d\n",
-                   tx_addr->u8[0], tx_addr->u8[1], ip, fp, conn->seqn);
+            printf("rp: new child %02x:%02x, my metric %u.%02u, my seqn %d\n",
+                   tx_addr->u8[0], tx_addr->u8[1], METRIC_Q124_INT(conn->metric), METRIC_Q124_FRAC(conn->metric), conn->seqn);
             #endif
               
         }
         else{//either it is a neighbor or an old child
             if(tx_e->type == NODE_CHILD){
                 //update entry
-                tx_e->type = NODE_NEIGHBOR;
-                //update the buffer (remove the entry)
-                int i;
-                for(i = 0; i < conn->tpl_buf.size; i++) {
-                    if(linkaddr_cmp(&conn->tpl_buf.stat_addr_arr[i].addr, tx_addr)) {
-                        //shift the array back
-                        int j;
-                        for(j = i; j < conn->tpl_buf.size - 1; j++) 
-                            conn->tpl_buf.stat_addr_arr[j] = conn->tpl_buf.stat_addr_arr[j + 1];
-                        conn->tpl_buf.size--;
-                        break;
-                    }
-                }
+                nbr_entry_set_type(nbr_tbl, tx_e, NODE_NEIGHBOR);
+#if !RP_NON_STORING
+                //its subtree left with it. Book its removal (it cancels a pending ADD),
+                //unless it re-attached under another child of this node
+                linkaddr_t nh;
+                if(!dsc_tbl_lookup(tx_addr, &nh))
+                    tpl_buf_put(conn, tx_addr, STATUS_REMOVE);
+                remove_descendants(conn, *tx_addr, true); //it moved: keep handing it their packets for a while
+#endif
               }
             //else it is a neighbor, no need to do anything (entry type is already up to date)
+            if(msg.seqn == conn->seqn) //the neighbor is consistent with this node
+                trickle_timer_consistency(&conn->beacon_tt);
             #if USR_DEBUG == 1
-            float m = metric_q124_to_float(conn->metric);
-            int ip = (int)m;
-            int fp = (int)((m - ip) * 100);
-            printf("rp: new neighbor %02x:%02x, my metric %d.%02d, my seqn %d\n",
-                   tx_addr->u8[0], tx_addr->u8[1], ip, fp, conn->seqn);
+            printf("rp: new neighbor %02x:%02x, my metric %u.%02u, my seqn %d\n",
+                   tx_addr->u8[0], tx_addr->u8[1], METRIC_Q124_INT(conn->metric), METRIC_Q124_FRAC(conn->metric), conn->seqn);
             #endif
         }
       }
+    //keep the backup parent up to date with the latest beacon
+    if(!conn->sink) backup_update(conn, tx_addr, tx_e);
+
+#if !RP_NON_STORING
+    //topology changes piggybacked by a child
+    if(linkaddr_cmp(&msg.parent, &linkaddr_node_addr)){
+      uint8_t t_len;
+      const uint8_t* t = tlv_find(tlv, tlv_len, TLV_TPL, &t_len);
+      if(t != NULL) report_apply(conn, tx_addr, t, t_len);
+    }
+#endif
   }
 
 
@@ -332,52 +1115,454 @@ static void bc_recv(struct broadcast_conn* b_conn, const linkaddr_t *tx_addr) {
 /*----------------------------TOPOLOGY MAINTENANCE---------------------------*/
 
 
+#if RP_NON_STORING
+
+/*non-storing: tell the sink who the parent of this node is. The report is soft state, refreshed
+  every SUBTREE_REPORT_NODE_INTERVAL and sent at every parent change*/
 void subtree_report_cb(void* ptr){
 
     struct rp_conn* conn = (struct rp_conn*) ptr;
-    if(conn->tpl_buf.size == 0) {
-        ctimer_set(&subtree_report_timer, SUBTREE_REPORT_NODE_INTERVAL(conn->hops), subtree_report_cb, conn);
+    if(!conn->sink && !linkaddr_cmp(&conn->parent, &linkaddr_null)){
+        packetbuf_clear();
+        packetbuf_set_datalen(short_id_write(packetbuf_dataptr(), &conn->parent));
+        struct uc_hdr hdr = {.type = UC_TYPE_PAR_RPT, .d_addr = linkaddr_null, .s_addr = linkaddr_node_addr, .hops = 0};
+        uc_hdr_rank(conn, &hdr, &conn->parent);
+        if(uc_hdr_push(&hdr, NULL, 0))
+            tx_q_push(conn, &conn->parent, UC_TYPE_DATA); //queued as data: it can share a frame with the data going up
+        #if USR_DEBUG == 1
+        printf("rp: parent report, parent %02x:%02x\n", conn->parent.u8[0], conn->parent.u8[1]);
+        #endif
+    }
+    ctimer_set(&subtree_report_timer, SUBTREE_REPORT_NODE_INTERVAL(conn->hops), subtree_report_cb, conn);
+}
+
+/*---------------------------------------------------------------------------*/
+//parent report in the packetbuf: the sink records it, the other nodes send it up
+static void par_rpt_recv(struct rp_conn* conn, struct uc_hdr hdr){
+    if(!conn->sink){
+        uc_hdr_rank(conn, &hdr, &conn->parent);
+        if(!linkaddr_cmp(&conn->parent, &linkaddr_null) && uc_hdr_push(&hdr, NULL, 0))
+            tx_q_push(conn, &conn->parent, UC_TYPE_DATA);
+        return;
+    }
+    linkaddr_t par;
+    if(short_id_read(packetbuf_dataptr(), packetbuf_datalen(), &par) == 0) return;
+    if(!dsc_tbl_add(&hdr.s_addr, &par)){
+        #if USR_DEBUG == 1
+        printf("rp: parent map full, dropping %02x:%02x\n", hdr.s_addr.u8[0], hdr.s_addr.u8[1]);
+        #endif
         return;
     }
+    #if USR_DEBUG == 1
+    printf("rp: parent report, %02x:%02x -> %02x:%02x\n", hdr.s_addr.u8[0], hdr.s_addr.u8[1], par.u8[0], par.u8[1]);
+    #endif
+}
 
-    uint8_t rem = conn->tpl_buf.size - conn->buf_off;
-    uint8_t frag_sz = (rem > RP_MAX_STAT_PER_FRAG) ? RP_MAX_STAT_PER_FRAG : rem;
-    // build header
-    packetbuf_clear();
-    if(packetbuf_hdralloc(sizeof(struct uc_hdr))){
-        struct uc_hdr hdr = {.type = UC_TYPE_REPORT, .d_addr = conn->parent, .s_addr = linkaddr_node_addr, .hops = 0};
-        memcpy(packetbuf_hdrptr(), &hdr, sizeof(hdr));
+#if RP_SINK_IMAGE
+/*---------------------------------------------------------------------------*/
+//sink only: forget the nodes whose parent reports stopped (dead, or out of the network)
+static void par_map_timer_cb(void* ptr){
+    dsc_tbl_age(RP_PAR_MAP_MAX_AGE);
+    #if USR_DEBUG == 1
+    printf("rp: parent map aged, %u nodes\n", dsc_tbl_count());
+    #endif
+    ctimer_set(&par_map_timer, RP_PAR_MAP_SWEEP, par_map_timer_cb, ptr);
+}
+#endif
+
+/*---------------------------------------------------------------------------*/
+//sink only: route down to dst in the parent map. nexthop is set to the first hop, route to the
+//following ones (dst excluded). Returns the length of route, -1 if dst cannot be reached
+static int sr_build(const linkaddr_t* dst, linkaddr_t* nexthop, linkaddr_t* route){
+    linkaddr_t path[RP_SR_MAX_HOPS + 1]; //ancestors of dst, from its parent up
+    uint8_t n = 0;
+    linkaddr_t cur = *dst, par;
+    while(true){
+        if(!dsc_tbl_lookup(&cur, &par)) return -1; //unknown node: the chain breaks before the sink
+        if(linkaddr_cmp(&par, &linkaddr_node_addr)) break;
+        if(n == RP_SR_MAX_HOPS + 1) return -1; //too long, or a loop in the map
+        path[n++] = par;
+        cur = par;
     }
-    else{
+    if(n == 0){ //a child of the sink
+        *nexthop = *dst;
+        return 0;
+    }
+    *nexthop = path[n - 1];
+    uint8_t i;
+    for(i = 0; i < n - 1; i++)
+        route[i] = path[n - 2 - i];
+    return n - 1;
+}
+
+/*---------------------------------------------------------------------------*/
+//write the route at the start of the payload, with the type of the frame sent by the last hop
+static bool sr_push(const linkaddr_t* route, uint8_t n, uint8_t type){
+    uint8_t buf[1 + RP_SR_MAX_HOPS * (1 + LINKADDR_SIZE)];
+    uint8_t len = 1;
+    uint8_t i;
+    buf[0] = (type << SR_TYPE_SHIFT) | n;
+    for(i = 0; i < n; i++)
+        len += short_id_write(buf + len, &route[i]);
+    if(!packetbuf_hdralloc(len)) return false;
+    memcpy(packetbuf_hdrptr(), buf, len);
+    return true;
+}
+
+/*---------------------------------------------------------------------------*/
+//strip the route from the start of the payload. Returns false if it is malformed
+static bool sr_pull(linkaddr_t* route, uint8_t* n, uint8_t* type){
+    const uint8_t* p = packetbuf_dataptr();
+    uint16_t len = packetbuf_datalen();
+    if(len < 1 || (p[0] & SR_CNT_MASK) > RP_SR_MAX_HOPS) return false;
+    uint16_t used = 1;
+    uint8_t i, l;
+    for(i = 0; i < (p[0] & SR_CNT_MASK); i++){
+        if((l = short_id_read(p + used, len - used, &route[i])) == 0) return false;
+        used += l;
+    }
+    *n = p[0] & SR_CNT_MASK;
+    *type = p[0] >> SR_TYPE_SHIFT;
+    packetbuf_hdrreduce(used);
+    return true;
+}
+
+/*---------------------------------------------------------------------------*/
+//sink only: send the data or route error frame in the packetbuf (header stripped) down to hdr.d_addr
+static int sr_send(struct rp_conn* conn, struct uc_hdr hdr){
+    linkaddr_t nexthop;
+    linkaddr_t route[RP_SR_MAX_HOPS];
+    int n = 0;
+    const entry_t* e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &hdr.d_addr);
+    if(e != NULL)
+        nexthop = e->nexthop; //a neighbor
+    else if((n = sr_build(&hdr.d_addr, &nexthop, route)) < 0){
+        #if USR_DEBUG == 1
+        printf("rp: no source route to %02x:%02x, dropping packet\n", hdr.d_addr.u8[0], hdr.d_addr.u8[1]);
+        #endif
+        return -1;
+    }
+    if(hdr.type == UC_TYPE_SR) hdr.type = UC_TYPE_DATA;
+    if(n > 0){
+        if(!sr_push(route, n, hdr.type)) return -2;
+        hdr.type = UC_TYPE_SR;
+    }
+    uc_hdr_rank(conn, &hdr, &nexthop);
+    if(!uc_hdr_push(&hdr, NULL, 0)) return -2;
+    #if USR_DEBUG == 1
+    printf("rp: source routing packet to %02x:%02x via %02x:%02x, %d more hops\n",
+           hdr.d_addr.u8[0], hdr.d_addr.u8[1], nexthop.u8[0], nexthop.u8[1], n);
+    #endif
+    return tx_q_push(conn, &nexthop, UC_TYPE_DATA);
+}
+
+/*---------------------------------------------------------------------------*/
+//source routed frame in the packetbuf (header stripped): pop the next hop and send it on
+static void sr_forward(struct rp_conn* conn, struct uc_hdr hdr){
+    linkaddr_t route[RP_SR_MAX_HOPS];
+    uint8_t n, type;
+    if(!sr_pull(route, &n, &type)){
         #if USR_DEBUG == 1
-        printf("rp: ERROR, Failed to allocate unicast header!\n");
+        printf("rp: ERROR, malformed source route\n");
         #endif
         return;
     }
+    if(linkaddr_cmp(&hdr.d_addr, &linkaddr_node_addr)){ //the last hop sends plain data frames, but be lenient
+        if(type == UC_TYPE_DATA) conn->callbacks->recv(&hdr.s_addr, hdr.hops);
+        return;
+    }
+    linkaddr_t nexthop = (n > 0) ? route[0] : hdr.d_addr;
+    if(n > 1){
+        if(!sr_push(route + 1, n - 1, type)) return;
+    }
+    else //the next hop is the last one before the destination, or the destination
+        hdr.type = type;
+    uc_hdr_rank(conn, &hdr, &nexthop);
+    if(uc_hdr_push(&hdr, NULL, 0))
+        tx_q_push(conn, &nexthop, UC_TYPE_DATA);
+}
 
-    //build payload
-    uint8_t *pld = packetbuf_dataptr();
-    *pld = frag_sz;
-    memcpy(pld+1, &conn->tpl_buf.stat_addr_arr[conn->buf_off], frag_sz * sizeof(stat_addr_t));
-    packetbuf_set_datalen(1 + frag_sz * sizeof(stat_addr_t));
+#else
 
-    //send fragment
-    conn->last_uc_daddr = conn->parent;
-    unicast_send(&conn->uc, &conn->parent);
-    
-    conn->buf_off += frag_sz; //move offset
+void subtree_report_cb(void* ptr){
+
+    struct rp_conn* conn = (struct rp_conn*) ptr;
+    conn->rpt_q_wait = false;
+
+    //queue the fragments that fit in the window, up to RP_RPT_Q_MAX queued frames: they go to the parent as one burst
+    while(!conn->sink && !linkaddr_cmp(&conn->parent, &linkaddr_null)){
+        if(conn->tx_q_len >= RP_RPT_Q_MAX){ //leave room for the data: go on when tx_q_pop() frees a slot
+            conn->rpt_q_wait = conn->buf_off < conn->tpl_buf.size;
+            break;
+        }
+        // build header
+        packetbuf_clear();
+        struct uc_hdr hdr = {.type = UC_TYPE_REPORT, .d_addr = conn->parent, .s_addr = linkaddr_node_addr, .hops = 0};
+        if(!uc_hdr_push(&hdr, NULL, 0)){
+            #if USR_DEBUG == 1
+            printf("rp: ERROR, Failed to allocate unicast header!\n");
+            #endif
+            return;
+        }
+
+        //build payload: the next fragment, in the most compact encoding (see tpl_codec.h)
+        rpt_frag_t rec;
+        uint8_t len = rpt_frag_encode(conn, packetbuf_dataptr(), RPT_HDR_LEN + RP_TPL_META_LEN + RP_TPL_MAX_BYTES, &rec);
+        if(len == 0) break; //nothing left, or the window is full
+        packetbuf_set_datalen(len);
+
+        #if USR_DEBUG == 1
+        printf("rp: report fragment %u.%u (%u entries) in %u bytes (format 0x%02x)\n", rec.seq, rec.ff & RPT_FRAG_MASK,
+               rec.end - conn->buf_off, len, ((uint8_t*)packetbuf_dataptr())[RPT_HDR_LEN] & TPL_FMT_MASK);
+        #endif
+
+        if(!tx_q_enqueue(conn, &conn->parent, UC_TYPE_REPORT)){ //no memory: go on when tx_q_pop() frees it
+            conn->rpt_q_wait = true;
+            break;
+        }
+        rpt_frag_commit(conn, &rec);
+    }
+    if(!conn->tx_busy) tx_q_send_next(conn); //send the fragments
+
+    //the acks (or rpt_timer, or a free queue slot) move the report forward, this is the periodic refresh
+    ctimer_set(&subtree_report_timer, SUBTREE_REPORT_NODE_INTERVAL(conn->hops), subtree_report_cb, conn);
+}
 
-    //if all the buffer is sent, schedule next report, otherwise schedule next fragment
-    if(conn->buf_off < conn->tpl_buf.size) 
-        ctimer_set(&subtree_report_timer, CLOCK_SECOND / 50, subtree_report_cb, conn);
-    else {
-        //report completed, flush the buffer and schedule next
+
+/*---------------------------------------------------------------------------*/
+//apply a report fragment (standalone or piggybacked) from the child tx_addr, if it is the next one expected
+static void report_apply(struct rp_conn* conn, const linkaddr_t* tx_addr, const uint8_t* buf, uint16_t len){
+    entry_t* tx_e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, tx_addr);
+    if(tx_e == NULL || len < RPT_HDR_LEN) return; //no sequence state can be kept: the child will resend it
+    //only the children own descendants: a late fragment of a child that moved, or a report that came
+    //before the beacon that makes its sender a child, is dropped unacked (the sender resends it if needed)
+    if(tx_e->type != NODE_CHILD) return;
+    uint8_t seq = buf[0], ff = buf[1];
+
+    //the ack tells the child where to resume, whatever happens to this fragment
+    tx_e->rpt_ack = true;
+    if(ctimer_expired(&conn->rpt_ack_timer))
+        ctimer_set(&conn->rpt_ack_timer, RP_RPT_ACK_DELAY, rpt_ack_timer_cb, conn);
+
+    if(!(ff & RPT_SYNC) && (!tx_e->rpt_valid || RPT_KEY(seq, ff) != RPT_KEY(tx_e->rpt_seq, tx_e->rpt_frag))){
+      #if USR_DEBUG == 1
+      printf("rp: report fragment %u.%u from %02x:%02x out of sequence, expecting %u.%u%s\n", seq, ff & RPT_FRAG_MASK,
+             tx_addr->u8[0], tx_addr->u8[1], tx_e->rpt_seq, tx_e->rpt_frag, tx_e->rpt_valid ? "" : " (no state)");
+      #endif
+      return; //duplicate, or a fragment is missing
+    }
+
+    tpl_vec_t net_buf;
+    if(!tpl_decode(buf + RPT_HDR_LEN, len - RPT_HDR_LEN, &net_buf)){
+      #if USR_DEBUG == 1
+      printf("rp: ERROR, malformed topology report (%d bytes) from %02x:%02x\n", len, tx_addr->u8[0], tx_addr->u8[1]);
+      #endif
+      return;
+    }
+    //a full report replaces what the child reported so far: the nodes missing from it left its subtree
+    //(removal and re-adding of the others cancel out in the buffer for the parent)
+    if(ff & RPT_SYNC) remove_descendants(conn, *tx_addr, false);
+    tx_e->rpt_valid = true;
+    tx_e->rpt_seq = (ff & RPT_LAST) ? seq + 1 : seq;
+    tx_e->rpt_frag = (ff & RPT_LAST) ? 0 : (ff & RPT_FRAG_MASK) + 1;
+    #if USR_DEBUG == 1
+    print_topology_report(tx_addr, &net_buf);
+    printf("rp: report from child %02x:%02x\n", 
+      tx_addr->u8[0], tx_addr->u8[1]);
+    #endif
+
+    //update neighbor table with the incoming reports
+    nbr_tbl_update(nbr_tbl, conn, tx_addr, &net_buf);
+    //if not sink, schedule the next report. Otherwise, flush the buffer
+    if(!(conn->sink))
+        ctimer_set(&subtree_report_timer, SUBTREE_REPORT_DELAY, subtree_report_cb, conn); //send the report in upstream, piggybacking the local information also
+    else
         flush_tpl_buf(conn);
+}
+
+/*---------------------------------------------------------------------------*/
+//encode into buf (at most max_len bytes) the report fragment that starts at buf_off. A fragment in flight
+//is encoded again with its label and its changes, a new one gets the next label and the changes that fit.
+//Returns the bytes written (0: nothing to send, or it does not fit), rec is set to the fragment
+static uint8_t rpt_frag_encode(struct rp_conn* conn, uint8_t* buf, uint8_t max_len, rpt_frag_t* rec){
+    uint16_t start = conn->buf_off;
+    uint8_t n_enc, len;
+    if(start < conn->sent_off){ //retransmission
+        uint8_t i = 0;
+        while(i < conn->rpt_cnt && conn->rpt_win[i].end <= start) i++;
+        if(i == conn->rpt_cnt) return 0;
+        *rec = conn->rpt_win[i];
+        len = tpl_encode(&conn->tpl_buf.stat_addr_arr[start], rec->end - start, buf + RPT_HDR_LEN, max_len - RPT_HDR_LEN, &n_enc);
+        if(n_enc < rec->end - start) return 0;
+    }
+    else{
+        if(start >= conn->tpl_buf.size || conn->rpt_cnt >= RP_RPT_WINDOW) return 0;
+        len = tpl_encode(&conn->tpl_buf.stat_addr_arr[start], conn->tpl_buf.size - start,
+                         buf + RPT_HDR_LEN, max_len - RPT_HDR_LEN, &n_enc);
+        if(n_enc == 0) return 0;
+        rec->seq = conn->rpt_seq;
+        rec->ff = conn->rpt_frag | (conn->rpt_sync ? RPT_SYNC : 0);
+        rec->end = start + n_enc;
+        if(rec->end == conn->tpl_buf.size || conn->rpt_frag == RPT_FRAG_MASK) rec->ff |= RPT_LAST;
+    }
+    buf[0] = rec->seq;
+    buf[1] = rec->ff;
+    return RPT_HDR_LEN + len;
+}
+
+/*---------------------------------------------------------------------------*/
+//the fragment encoded by rpt_frag_encode() is on its way: it stays in flight until acked
+static void rpt_frag_commit(struct rp_conn* conn, const rpt_frag_t* rec){
+    if(conn->buf_off >= conn->sent_off){ //new fragment
+        conn->rpt_win[conn->rpt_cnt++] = *rec;
+        conn->sent_off = rec->end;
+        conn->rpt_sync = false;
+        if(rec->ff & RPT_LAST){
+            conn->rpt_seq++;
+            conn->rpt_frag = 0;
+        }
+        else conn->rpt_frag++;
+    }
+    conn->buf_off = rec->end;
+    if(ctimer_expired(&conn->rpt_timer))
+        ctimer_set(&conn->rpt_timer, RP_RPT_TIMEOUT << conn->rpt_retx, rpt_timer_cb, conn);
+}
+
+/*---------------------------------------------------------------------------*/
+//no ack for the fragments in flight: send them again, from the oldest one
+static void rpt_timer_cb(void* ptr){
+    struct rp_conn* conn = (struct rp_conn*)ptr;
+    if(conn->rpt_cnt == 0) return;
+    if(conn->rpt_retx < RP_RPT_BACKOFF_MAX) conn->rpt_retx++;
+    conn->buf_off = 0;
+    #if USR_DEBUG == 1
+    printf("rp: report ack timeout, resending %u fragments\n", conn->rpt_cnt);
+    #endif
+    subtree_report_cb(conn);
+}
+
+/*---------------------------------------------------------------------------*/
+//a frame with a piggybacked fragment was not queued, or was not acked by the MAC: do not wait
+//for the ack timeout, send the fragments in flight again from the oldest one
+static void rpt_frag_lost(struct rp_conn* conn){
+    if(conn->rpt_cnt == 0) return;
+    conn->buf_off = 0;
+    #if USR_DEBUG == 1
+    printf("rp: piggybacked report fragment lost, resending %u fragments\n", conn->rpt_cnt);
+    #endif
+    ctimer_set(&subtree_report_timer, SUBTREE_REPORT_DELAY, subtree_report_cb, conn);
+}
+
+/*---------------------------------------------------------------------------*/
+//the parent expects the fragment labeled seq, ff (RPT_SYNC: it has no sequence state for this node)
+static void rpt_ack_apply(struct rp_conn* conn, const linkaddr_t* tx_addr, uint8_t seq, uint8_t ff){
+    if(conn->sink || !linkaddr_cmp(tx_addr, &conn->parent)) return;
+    uint16_t key = RPT_KEY(seq, ff);
+    uint16_t next = RPT_KEY(conn->rpt_seq, conn->rpt_frag);
+    uint8_t i = 0;
+    if(!(ff & RPT_SYNC)){
+        uint16_t first = (conn->rpt_cnt > 0) ? RPT_KEY(conn->rpt_win[0].seq, conn->rpt_win[0].ff) : next;
+        if(RPT_BEFORE(key, first)) return; //stale ack
+        while(i < conn->rpt_cnt && RPT_BEFORE(RPT_KEY(conn->rpt_win[i].seq, conn->rpt_win[i].ff), key)) i++;
+    }
+
+    if((ff & RPT_SYNC) || ((i < conn->rpt_cnt) ? RPT_KEY(conn->rpt_win[i].seq, conn->rpt_win[i].ff) != key : key != next)){
+        //the parent lost the sequence state, or has a state this node never had: resync
+        #if USR_DEBUG == 1
+        printf("rp: parent %02x:%02x expects report fragment %u.%u, resync\n", tx_addr->u8[0], tx_addr->u8[1], seq, ff & RPT_FRAG_MASK);
+        #endif
+        buff_subtree(nbr_tbl, conn);
+    }
+    else if(i > 0){ //fragments acked: drop their changes
+        uint16_t drop = conn->rpt_win[i - 1].end;
+        memmove(&conn->tpl_buf.stat_addr_arr[0], &conn->tpl_buf.stat_addr_arr[drop], (conn->tpl_buf.size - drop) * sizeof(stat_addr_t));
+        conn->tpl_buf.size -= drop;
+        conn->sent_off -= drop;
+        conn->buf_off = (conn->buf_off > drop) ? conn->buf_off - drop : 0;
+        conn->rpt_cnt -= i;
+        uint8_t j;
+        for(j = 0; j < conn->rpt_cnt; j++){
+            conn->rpt_win[j] = conn->rpt_win[j + i];
+            conn->rpt_win[j].end -= drop;
+        }
+        conn->rpt_retx = 0;
+        if(conn->rpt_cnt > 0)
+            ctimer_set(&conn->rpt_timer, RP_RPT_TIMEOUT, rpt_timer_cb, conn);
+        else
+            ctimer_stop(&conn->rpt_timer);
+    }
+    else if(conn->rpt_cnt > 0) //duplicate ack: the oldest fragment in flight is missing
         conn->buf_off = 0;
-        ctimer_set(&subtree_report_timer, SUBTREE_REPORT_NODE_INTERVAL(conn->hops), subtree_report_cb, conn);
+
+    if(conn->buf_off < conn->tpl_buf.size)
+        ctimer_set(&subtree_report_timer, SUBTREE_REPORT_DELAY, subtree_report_cb, conn);
+}
+
+/*---------------------------------------------------------------------------*/
+//write the ack owed to a child: the label of the next fragment expected
+static void rpt_ack_write(const entry_t* e, uint8_t* buf){
+    buf[0] = e->rpt_seq;
+    buf[1] = e->rpt_valid ? e->rpt_frag : RPT_SYNC;
+}
+
+/*---------------------------------------------------------------------------*/
+//write the ack owed to the next hop (a child) as a TLV_RPT_ACK. Returns the bytes written
+static uint8_t rpt_ack_piggyback(const linkaddr_t* nexthop, uint8_t* buf, uint8_t max_len){
+    entry_t* e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, nexthop);
+    if(e == NULL || !e->rpt_ack || max_len < TLV_HDR_LEN + RPT_HDR_LEN) return 0;
+    buf[0] = TLV_RPT_ACK;
+    buf[1] = RPT_HDR_LEN;
+    rpt_ack_write(e, buf + TLV_HDR_LEN);
+    e->rpt_ack = false;
+    return TLV_HDR_LEN + RPT_HDR_LEN;
+}
+
+/*---------------------------------------------------------------------------*/
+//send the acks that no frame to the children carried
+static void rpt_ack_timer_cb(void* ptr){
+    struct rp_conn* conn = (struct rp_conn*)ptr;
+    entry_t* e;
+    for(e = nbr_table_head(nbr_tbl); e != NULL; e = nbr_table_next(nbr_tbl, e)){
+        if(!e->rpt_ack) continue;
+        const linkaddr_t* addr = nbr_table_get_lladdr(nbr_tbl, e);
+        packetbuf_clear();
+        rpt_ack_write(e, packetbuf_dataptr());
+        packetbuf_set_datalen(RPT_HDR_LEN);
+        struct uc_hdr hdr = {.type = UC_TYPE_RPT_ACK, .d_addr = *addr, .s_addr = linkaddr_node_addr, .hops = 0};
+        if(!uc_hdr_push(&hdr, NULL, 0) || !tx_q_push(conn, addr, UC_TYPE_RPT_ACK)){
+            ctimer_set(&conn->rpt_ack_timer, RP_RPT_ACK_DELAY, rpt_ack_timer_cb, conn); //queue full: try again later
+            return;
+        }
+        e->rpt_ack = false;
     }
 }
 
+/*---------------------------------------------------------------------------*/
+//write the next new report fragment as a TLV_TPL, if it fits in max_len bytes (retransmissions go in
+//standalone reports). Returns the bytes written
+static uint8_t tpl_piggyback(struct rp_conn* conn, uint8_t* buf, uint8_t max_len){
+    if(conn->sink || conn->buf_off < conn->sent_off || max_len < TLV_HDR_LEN + RPT_HDR_LEN + 3) return 0;
+    rpt_frag_t rec;
+    uint8_t len = rpt_frag_encode(conn, buf + TLV_HDR_LEN, max_len - TLV_HDR_LEN, &rec);
+    if(len == 0) return 0;
+    buf[0] = TLV_TPL;
+    buf[1] = len;
+    #if USR_DEBUG == 1
+    printf("rp: piggybacking report fragment %u.%u (%u topology changes) in %u bytes\n",
+           rec.seq, rec.ff & RPT_FRAG_MASK, rec.end - conn->buf_off, len);
+    #endif
+    rpt_frag_commit(conn, &rec);
+    return TLV_HDR_LEN + len;
+}
+
+/*---------------------------------------------------------------------------*/
+//room for TLVs in a data frame with the payload in the packetbuf
+static uint8_t uc_tlv_room(void){
+    uint16_t used = packetbuf_datalen() + UC_HC_MAX_LEN + 2; //worst case header, extension and TLVs length bytes
+    if(used >= RP_AGG_MAX_LEN) return 0;
+    return (RP_AGG_MAX_LEN - used > RP_TLV_MAX_LEN) ? RP_TLV_MAX_LEN : RP_AGG_MAX_LEN - used;
+}
+#endif /* RP_NON_STORING */
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
@@ -386,25 +1571,155 @@ void subtree_report_cb(void* ptr){
 /*---------------------------------------------------------------------------*/
 /*Helper  for change_parent: bufferize the subtree to send as topology report to the new parent*/
 static void buff_subtree(nbr_table_t* nbr_tbl, struct rp_conn* conn){
+#if !RP_NON_STORING //non-storing: there is no subtree to report, the parent report goes with subtree_report_cb()
     /*Flush topology buffer: no need to keep track of expired entries or topology changes,
     only the effective valod descendants need to the new parent, so we rebuild the buffer from scratch*/
-    conn->tpl_buf.size = 0;
+    flush_tpl_buf(conn);
+    conn->rpt_sync = true; //full report: the parent takes it whatever it expects
+    conn->rpt_seq++;
     entry_t* e;
     for(e=nbr_table_head(nbr_tbl); e != NULL; e = nbr_table_next(nbr_tbl, e)){
-        //find all elements of the subtree
-        if( !(e->type == NODE_DESCENDANT) && !(e->type == NODE_CHILD))
+        //find all the children
+        if(e->type != NODE_CHILD)
             continue;
-        else{
-            linkaddr_t d_addr = *nbr_table_get_lladdr(nbr_tbl, e);
-            stat_addr_t d_stat = {.addr = d_addr, .status = STATUS_ADD};
-            conn->tpl_buf.stat_addr_arr[conn->tpl_buf.size++] = d_stat;
-        }
+        else
+            tpl_buf_put(conn, nbr_table_get_lladdr(nbr_tbl, e), STATUS_ADD);
+    }
+    //and all the descendants
+    uint16_t i;
+    for(i = 0; i < DSC_TBL_SIZE; i++){
+        const dsc_entry_t* d = dsc_tbl_get(i);
+        if(d != NULL && !tpl_buf_put(conn, &d->addr, STATUS_ADD))
+            break; //buffer full
     }
+#endif
   }
 
 /*---------------------------------------------------------------------------*/
 /*---------------------------------------------------------------------------*/
 
+/*---------------------------------------------------------------------------*/
+/*A neighbor can back up the parent if it is closer to the sink than this node and it is not
+  in this node's subtree: switching to it cannot create a loop*/
+static bool backup_eligible(struct rp_conn* conn, const linkaddr_t* addr, const entry_t* e){
+    linkaddr_t nh;
+    //a parent given up on NOACK is marked ALWAYS_INVALID_AGE: VALID() alone may still take it (boot, clock wrap)
+    return e->type == NODE_NEIGHBOR && e->age != ALWAYS_INVALID_AGE && VALID(e->age) && e->adv_metric < conn->metric
+        && !linkaddr_cmp(addr, &conn->parent) && !dsc_tbl_lookup(addr, &nh);
+}
+
+/*---------------------------------------------------------------------------*/
+/*find the best backup parent in the neighbor table*/
+static void backup_select(struct rp_conn* conn){
+    metric_q124_t bst_mt = METRIC_Q124_INF;
+    linkaddr_copy(&conn->backup, &linkaddr_null);
+    entry_t* e = par_cand_best();
+    if(e != NULL && backup_eligible(conn, nbr_table_get_lladdr(nbr_tbl, e), e)){ //usually the best candidate
+        linkaddr_copy(&conn->backup, nbr_table_get_lladdr(nbr_tbl, e));
+        return;
+    }
+    for(e = nbr_table_head(nbr_tbl); e != NULL; e = nbr_table_next(nbr_tbl, e)){
+        const linkaddr_t* addr = nbr_table_get_lladdr(nbr_tbl, e);
+        metric_q124_t cnd_mt = nbr_path_metric(e);
+        if(backup_eligible(conn, addr, e) && cnd_mt < bst_mt){
+            bst_mt = cnd_mt;
+            linkaddr_copy(&conn->backup, addr);
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*a beacon from addr was processed: update the backup parent without scanning the table,
+  unless the current backup is not usable anymore*/
+static void backup_update(struct rp_conn* conn, const linkaddr_t* addr, const entry_t* e){
+    if(linkaddr_cmp(addr, &conn->backup)){
+        if(!backup_eligible(conn, addr, e)) backup_select(conn);
+        return;
+    }
+    if(!backup_eligible(conn, addr, e)) return;
+    const entry_t* b = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &conn->backup);
+    if(b == NULL || !backup_eligible(conn, &conn->backup, b) || nbr_path_metric(e) < nbr_path_metric(b))
+        linkaddr_copy(&conn->backup, addr);
+}
+
+/*---------------------------------------------------------------------------*/
+/*the parent changed: the frames queued for the old one go to the new one. The frame in flight
+  keeps its next hop until its result comes back (the link estimate is attributed to it)*/
+static void tx_q_redirect(struct rp_conn* conn, const linkaddr_t* old_par){
+    struct rp_tx_item* it;
+    for(it = list_head(conn->tx_q); it != NULL; it = list_item_next(it)){
+        if(conn->tx_busy && it == list_head(conn->tx_q)) continue;
+        if(linkaddr_cmp(&it->nexthop, old_par)){
+            linkaddr_copy(&it->nexthop, &conn->parent);
+            it->retx = 0;
+        }
+    }
+}
+
+/*---------------------------------------------------------------------------*/
+/*switch to a better candidate parent: the new parent learns the subtree with the next report*/
+static void parent_switch(struct rp_conn* conn, entry_t* new_par_e){
+    linkaddr_t old_par = conn->parent;
+    entry_t* old_par_e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &old_par);
+    if(old_par_e != NULL) nbr_entry_set_type(nbr_tbl, old_par_e, NODE_NEIGHBOR);
+
+    linkaddr_copy(&conn->parent, nbr_table_get_lladdr(nbr_tbl, new_par_e));
+    tx_q_redirect(conn, &old_par);
+    conn->metric = new_par_e->cand_mt;
+    conn->hops = (new_par_e->hops == 0xFF) ? 0xFF : new_par_e->hops + 1;
+    nbr_entry_set_type(nbr_tbl, new_par_e, NODE_PARENT);
+    #if USR_DEBUG == 1
+    printf("rp: switching to better parent %02x:%02x, my new metric %u.%02u\n",
+           conn->parent.u8[0], conn->parent.u8[1], METRIC_Q124_INT(conn->metric), METRIC_Q124_FRAC(conn->metric));
+    #endif
+    backup_select(conn);
+    beacon_reset(conn);
+    buff_subtree(nbr_tbl, conn);
+    ctimer_set(&subtree_report_timer, SUBTREE_REPORT_BASE_DEL(conn->hops), subtree_report_cb, conn);
+}
+
+/*---------------------------------------------------------------------------*/
+/*if the parent got worse, another candidate may now be clearly better (O(1) check)*/
+static void parent_reeval(struct rp_conn* conn){
+    entry_t* best = par_cand_best();
+    if(best != NULL && VALID(best->age) && preferred(best->cand_mt, conn->metric))
+        parent_switch(conn, best);
+}
+
+/*---------------------------------------------------------------------------*/
+/*The parent did not ACK: switch to the backup parent at once, and move to it the frames
+  queued for the old parent (the failed one included: its result is in). The new parent learns the subtree
+  with the next scheduled report. Returns false if there is no usable backup*/
+static bool parent_failover(struct rp_conn* conn){
+    entry_t* b = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &conn->backup);
+    if(b == NULL || !backup_eligible(conn, &conn->backup, b)) return false;
+
+    linkaddr_t old_par = conn->parent;
+    entry_t* old_par_e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &old_par);
+    if(old_par_e != NULL){
+        old_par_e->age = ALWAYS_INVALID_AGE; //set as expired
+        nbr_entry_set_type(nbr_tbl, old_par_e, NODE_NEIGHBOR); //downgrade the old parent to neighbor
+    }
+
+    linkaddr_copy(&conn->parent, &conn->backup);
+    conn->metric = nbr_path_metric(b);
+    conn->hops = (b->hops == 0xFF) ? 0xFF : b->hops + 1;
+    nbr_entry_set_type(nbr_tbl, b, NODE_PARENT);
+
+    tx_q_redirect(conn, &old_par);
+
+    #if USR_DEBUG == 1
+    printf("rp: parent %02x:%02x lost, failover to backup %02x:%02x, my new metric %u.%02u\n",
+           old_par.u8[0], old_par.u8[1], conn->parent.u8[0], conn->parent.u8[1],
+           METRIC_Q124_INT(conn->metric), METRIC_Q124_FRAC(conn->metric));
+    #endif
+    backup_select(conn);
+    beacon_reset(conn); //advertise the new metric
+    buff_subtree(nbr_tbl, conn);
+    ctimer_set(&subtree_report_timer, SUBTREE_REPORT_BASE_DEL(conn->hops), subtree_report_cb, conn);
+    return true;
+}
+
 /*---------------------------------------------------------------------------*/
 void change_parent(void* ptr){ //change parent and mark as expired the old parent
     cb_args_t* args = (cb_args_t*) ptr;
@@ -413,48 +1728,49 @@ void change_parent(void* ptr){ //change parent and mark as expired the old paren
    
     linkaddr_t old_par = conn->parent;
 
-    //Iterate the neighbor table and find the best neighbor
-    float bst_mt = FLT_MAX;
-    entry_t* new_par_e = NULL;
-    entry_t* e;
-    for(e=nbr_table_head(nbr_tbl); e!=NULL; e=nbr_table_next(nbr_tbl, e)){
-        if(e->type != NODE_NEIGHBOR) continue; //skip entries that are not neighbors
-
-        float cnd_mt = metric(metric_q124_to_float(e->adv_metric), e->etx);
-        if(cnd_mt < bst_mt){
-            bst_mt = cnd_mt;
-            new_par_e = e;
-        }
-    }
+    //the best neighbor is at the top of the candidate heap
+    entry_t* new_par_e = par_cand_best();
+    if(new_par_e != NULL && new_par_e->cand_mt == METRIC_Q124_INF) new_par_e = NULL;
 
     entry_t* old_par_e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &old_par);
     if(old_par_e != NULL){
-        old_par_e->type = NODE_NEIGHBOR; //downgrade the old parent to neighbor
         old_par_e->age = ALWAYS_INVALID_AGE; //set as expired
+        nbr_entry_set_type(nbr_tbl, old_par_e, NODE_NEIGHBOR); //downgrade the old parent to neighbor
     }
 
     if(new_par_e != NULL){
         conn->parent = *(nbr_table_get_lladdr(nbr_tbl, new_par_e));
-        conn->metric = metric_float_to_q124(bst_mt);
-        new_par_e->type = NODE_PARENT;
+        tx_q_redirect(conn, &old_par); //the frames queued for the old parent go up at once
+        conn->metric = new_par_e->cand_mt;
+        nbr_entry_set_type(nbr_tbl, new_par_e, NODE_PARENT);
         conn->hops = new_par_e->hops + 1;
 
         #if USR_DEBUG == 1
-        metric_q124_t m = conn->metric;
-        int ip = m >> 8;
-        int fp = ((m & 0xFF) * 100 + 128) >> 8;
-        printf("rp: parent change from %02x:%02x to %02x:%02x, my new metric %d.%02d, my seqn %d\n", 
-           old_par.u8[0], old_par.u8[1], new_par_e->nexthop.u8[0], new_par_e->nexthop.u8[1], ip, fp, conn->seqn);
+        printf("rp: parent change from %02x:%02x to %02x:%02x, my new metric %u.%02u, my seqn %d\n", 
+           old_par.u8[0], old_par.u8[1], new_par_e->nexthop.u8[0], new_par_e->nexthop.u8[1],
+           METRIC_Q124_INT(conn->metric), METRIC_Q124_FRAC(conn->metric), conn->seqn);
         #endif
+        backup_select(conn);
+        beacon_reset(conn); //advertise the new metric
         //Inform the new parent of the subtree
         buff_subtree(nbr_tbl, conn);
         subtree_report_cb(conn);
     }
     else{//if there are no neighbors available, disconnect from the network
         linkaddr_copy(&conn->parent, &linkaddr_null);
+        linkaddr_copy(&conn->backup, &linkaddr_null);
+        conn->metric = METRIC_Q124_INF;
+        conn->hops = 0xFF;
         #if USR_DEBUG == 1
         printf("rp: Node %02x:%02x did not find a parent, disconnecting from the network\n", linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1]); 
         #endif
+        if(!conn->orphan){ //time to rejoin
+            conn->orphan = true;
+            #if RP_LOG_TREE == 1
+            printf("RP: Orphaned\n");
+            #endif
+        }
+        solicit_start(conn);
         return;
   }
 }
@@ -466,11 +1782,40 @@ static void uc_recv(struct unicast_conn* u_conn, const linkaddr_t* tx_addr){
 
     struct rp_conn* conn = (struct rp_conn*)( ((uint8_t*)u_conn) - offsetof(struct rp_conn, uc));
 
+    //aggregate frame: process every record as a frame of its own
+    if(packetbuf_datalen() > 0 && *(uint8_t*)packetbuf_dataptr() == UC_AGG_HDR){
+      uint8_t agg[PACKETBUF_SIZE];
+      uint16_t len = packetbuf_copyto(agg);
+      uint16_t off = 1;
+      while(off < len){
+        uint8_t rec_len = agg[off++];
+        if(rec_len == 0 || off + rec_len > len){
+          #if USR_DEBUG == 1
+          printf("rp: ERROR, malformed aggregate frame from %02x:%02x\n", tx_addr->u8[0], tx_addr->u8[1]);
+          #endif
+          return;
+        }
+        packetbuf_clear();
+        packetbuf_copyfrom(agg + off, rec_len);
+        uc_dispatch(conn, tx_addr);
+        off += rec_len;
+      }
+      return;
+    }
+    uc_dispatch(conn, tx_addr);
+}
+
+/*---------------------------------------------------------------------------*/
+//process a single (non aggregate) frame in the packetbuf
+static void uc_dispatch(struct rp_conn* conn, const linkaddr_t* tx_addr){
 
-    // Check if the received unicast message looks legitimate
-    if (packetbuf_datalen() < sizeof(struct uc_hdr)) {
+    // Check if the received unicast message looks legitimate, and strip the header
+    struct uc_hdr hdr;
+    uint8_t tlv[RP_TLV_MAX_LEN];
+    uint8_t tlv_len;
+    if (!uc_hdr_pull(&hdr, tx_addr, tlv, &tlv_len)) {
       #if USR_DEBUG == 1
-      printf("rp: ERROR, too short unicast packet %d. ", packetbuf_datalen());
+      printf("rp: ERROR, malformed unicast header. ");
       printf("Received packet of length %d from %02x:%02x\n", packetbuf_datalen(), tx_addr->u8[0], tx_addr->u8[1]);
       const uint8_t *raw_data = (uint8_t *)packetbuf_dataptr();
       int i;
@@ -481,11 +1826,8 @@ static void uc_recv(struct unicast_conn* u_conn, const linkaddr_t* tx_addr){
       return;
     }
 
-    struct uc_hdr hdr;
-    memcpy(&hdr, packetbuf_dataptr(), sizeof(hdr));
-    packetbuf_hdrreduce(sizeof(hdr)); 
     hdr.hops = hdr.hops +1; //increment hop count in the header to be forwarded
-    if(hdr.hops > MAX_PATH_LENGTH) return; //drop if reached the maximum path length
+    if(hdr.hops > RP_MAX_HOPS) return; //drop if reached the maximum path length
 
     #if USR_DEBUG == 1
     printf("[LOG] Node %02x:%02x RECEIVED packet from %02x:%02x originally sent by %02x:%02x (hops: %d)\n",
@@ -496,55 +1838,63 @@ static void uc_recv(struct unicast_conn* u_conn, const linkaddr_t* tx_addr){
     #endif
 
     nbr_tbl_refresh(nbr_tbl, tx_addr); //refresh entry
+
+    //a routed frame that will be forwarded: check for loops
+    if(!UC_TYPE_HOP_LOCAL(hdr.type) && !linkaddr_cmp(&hdr.d_addr, &linkaddr_node_addr) && !rank_check(conn, &hdr)) return;
+
+#if !RP_NON_STORING
+    //topology changes piggybacked by a child: apply them first, so that a frame forwarded
+    //upwards right after can carry them on
+    uint8_t t_len;
+    const uint8_t* t = tlv_find(tlv, tlv_len, TLV_TPL, &t_len);
+    if(t != NULL) report_apply(conn, tx_addr, t, t_len);
+    //report ack piggybacked by the parent
+    t = tlv_find(tlv, tlv_len, TLV_RPT_ACK, &t_len);
+    if(t != NULL && t_len == RPT_HDR_LEN) rpt_ack_apply(conn, tx_addr, t[0], t[1]);
+#endif
+
     switch(hdr.type){
         case UC_TYPE_DATA: //application data pakcet
             //if this node is the destination, then call the application. Otherwise forward
             if(linkaddr_cmp(&hdr.d_addr, &linkaddr_node_addr))
               conn->callbacks->recv(&hdr.s_addr, hdr.hops); //call the recv callback function
             else
-              forward_data(conn, hdr);
+              forward_data(conn, hdr, tx_addr);
             break;
 
-        case UC_TYPE_REPORT:
-            #if USR_DEBUG == 1
-            print_topology_report(tx_addr);
-            printf("rp: report from child %02x:%02x\n", 
-              tx_addr->u8[0], tx_addr->u8[1]);
-            #endif
-
-            /*Extract report forom the packet buffer*/
-            if(packetbuf_datalen() < sizeof(uint8_t)){
-              #if USR_DEBUG == 1
-              printf("rp: ERROR, packet too short (%d bytes)\n", packetbuf_datalen());
-              #endif
-              return;
+        case UC_TYPE_RERR: //route error: the destination in the payload is not reachable
+            if(linkaddr_cmp(&hdr.d_addr, &linkaddr_node_addr)){
+              linkaddr_t unreach;
+              if(short_id_read(packetbuf_dataptr(), packetbuf_datalen(), &unreach) > 0){
+                neg_cache_add(&unreach);
+                #if USR_DEBUG == 1
+                printf("rp: route error from %02x:%02x, %02x:%02x is unreachable\n",
+                       hdr.s_addr.u8[0], hdr.s_addr.u8[1], unreach.u8[0], unreach.u8[1]);
+                #endif
+              }
             }
-            
-            tpl_vec_t net_buf;
-            uint8_t* dataptr = packetbuf_dataptr();
-            net_buf.size = *dataptr; //set size of the incoming topology vector (first byte of the packet is size)
-            dataptr++;
-           // Ensure the packet contains the expected amount of data
-             uint8_t exp_b = net_buf.size * sizeof(stat_addr_t);
-             if((packetbuf_datalen() - 1) < exp_b) {
-               #if USR_DEBUG == 1
-               printf("rp: ERROR: Insufficient data: expected %u bytes for %u entries\n", exp_b, net_buf.size);
-               #endif
-               return;
-             }
-             // Read each stat_addr_t from the packet into net_buf's array
-             uint8_t i;
-             for(i = 0; i < net_buf.size; i++)
-                 memcpy(&net_buf.stat_addr_arr[i], dataptr + i * sizeof(stat_addr_t), sizeof(stat_addr_t));
-            
-          //update neighbor table with the incoming reports
-            nbr_tbl_update(nbr_tbl, conn, tx_addr, net_buf);
-            //if not sink, schedule the next report. Otherwise, flush the buffer
-            if(!(conn->sink))
-                ctimer_set(&subtree_report_timer, SUBTREE_REPORT_DELAY, subtree_report_cb, conn); //send the report in upstream, piggybacking the local information also
             else
-                flush_tpl_buf(conn);
-            break;  
+              forward_data(conn, hdr, tx_addr);
+            break;
+
+#if RP_NON_STORING
+        case UC_TYPE_SR: //source routed frame from the sink
+            sr_forward(conn, hdr);
+            break;
+
+        case UC_TYPE_PAR_RPT: //parent report, to the sink
+            par_rpt_recv(conn, hdr);
+            break;
+#else
+        case UC_TYPE_REPORT: //standalone report (compact or legacy encoding)
+            report_apply(conn, tx_addr, packetbuf_dataptr(), packetbuf_datalen());
+            break;
+
+        case UC_TYPE_RPT_ACK: //explicit report ack from the parent
+            if(packetbuf_datalen() == RPT_HDR_LEN)
+              rpt_ack_apply(conn, tx_addr, ((uint8_t*)packetbuf_dataptr())[0], ((uint8_t*)packetbuf_dataptr())[1]);
+            break;
+#endif
           
         default:
             break;
@@ -554,31 +1904,58 @@ static void uc_recv(struct unicast_conn* u_conn, const linkaddr_t* tx_addr){
 static void uc_sent(struct unicast_conn *c, int status, int num_tx){
 
   struct rp_conn* conn = (struct rp_conn*)(((uint8_t*)c) - offsetof(struct rp_conn, uc));
-  entry_t* e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &conn->last_uc_daddr);
-
-  if(e != NULL){
-    e->num_tx += num_tx; //increment the number of transmissions with the MAC trasmissions
-    if(status == MAC_TX_OK) e->num_ack++; //increment number of ACKs if the receiver acked
-      e->etx = etx_update(e->num_tx, e->num_ack, e->etx, packetbuf_attr(PACKETBUF_ATTR_RSSI));
+  if(conn->tx_in_send){ //reported from inside unicast_send()
+    tx_late_set(conn, status, num_tx);
+    return;
+  }
+  struct rp_tx_item* it = list_head(conn->tx_q); //the frame in flight
+  if(it == NULL || !conn->tx_busy) return;
+  conn->tx_busy = false;
+  it->num_tx = (it->num_tx + num_tx > 0xFF) ? 0xFF : it->num_tx + num_tx;
+  linkaddr_t daddr = it->nexthop;
+  entry_t* e = (entry_t*) nbr_table_get_from_lladdr(nbr_tbl, &daddr);
+
+  /*Update ETX: only frames that went on air say something about the link*/
+  if(e != NULL && (status == MAC_TX_OK || status == MAC_TX_NOACK)){
+    link_est_tx(&e->le, num_tx, status == MAC_TX_OK);
+    nbr_tbl_cleanup_arm(conn, NBR_TBL_CLEANUP_INTERVAL); //the new sample has to be aged
+    par_cand_update(e);
+    if(e->type == NODE_PARENT && status == MAC_TX_OK){ //the metric through the parent follows the link (NOACK: failover below)
+      conn->metric = nbr_path_metric(e);
+      parent_reeval(conn);
+    }
   }
 
-  /*Update ETX*/
-
-  if(e != NULL)
-    e->num_tx += num_tx; //increment the number of transmissions with the MAC trasmissions
+  //transient failure: retry the same frame
+  if((status == MAC_TX_COLLISION || status == MAC_TX_ERR) && it->retx < RP_TX_MAX_RETX){
+    it->retx++;
+    tx_q_send_next(conn);
+    return;
+  }
+  //the parent did not ACK: fail over to the backup parent and retransmit the frame to it
+  if(status == MAC_TX_NOACK && e != NULL && e->type == NODE_PARENT && parent_failover(conn)){
+    tx_q_send_next(conn);
+    return;
+  }
+  #if USR_DEBUG == 1
+  printf("rp: frame type %u to %02x:%02x done after %lu ticks in queue, %u frames left\n",
+         it->type, daddr.u8[0], daddr.u8[1], (unsigned long)(clock_time() - it->enq_time), conn->tx_q_len - 1);
+  #endif
+  tx_q_pop(conn, status);
 
   switch(status){
     case MAC_TX_OK:
       #if USR_DEBUG == 1
       printf("rp: Packet sent successfully (ACK received), retransmissions: %d\n", num_tx);
       #endif
-      nbr_tbl_refresh(nbr_tbl, &conn->last_uc_daddr); //refresh entry
+      nbr_tbl_refresh(nbr_tbl, &daddr); //refresh entry
       break;
 
     case MAC_TX_NOACK:
       #if USR_DEBUG == 1
       printf("rp: Packet transmission failed (NO ACK), retransmissions: %d.\n", num_tx);      
       #endif
+      if(e == NULL) break;
       switch(e->type){
         case NODE_PARENT:
         //If the parent is not responding, then change parent
@@ -592,7 +1969,7 @@ static void uc_sent(struct unicast_conn *c, int status, int num_tx){
         case NODE_CHILD:
         //remove the subtree
           #if USR_DEBUG == 1
-          printf("rp: Removing child and subtree %02x:%02x from the routing table\n", conn->last_uc_daddr.u8[0], conn->last_uc_daddr.u8[1]);
+          printf("rp: Removing child and subtree %02x:%02x from the routing table\n", daddr.u8[0], daddr.u8[1]);
           #endif
           e->age = ALWAYS_INVALID_AGE;
           nbr_tbl_cleanup_cb(&conn->clu_args);
@@ -600,7 +1977,7 @@ static void uc_sent(struct unicast_conn *c, int status, int num_tx){
 
         case NODE_NEIGHBOR:
           #if USR_DEBUG == 1
-          printf("rp: Removing neighbor %02x:%02x from the routing table\n", conn->last_uc_daddr.u8[0], conn->last_uc_daddr.u8[1]);
+          printf("rp: Removing neighbor %02x:%02x from the routing table\n", daddr.u8[0], daddr.u8[1]);
           #endif
           e->age = ALWAYS_INVALID_AGE;
           nbr_tbl_cleanup_cb(&conn->clu_args);
@@ -614,7 +1991,8 @@ static void uc_sent(struct unicast_conn *c, int status, int num_tx){
     default:
       break;
   }
-  
+
+  if(!conn->tx_busy) tx_q_send_next(conn); //the status handling may already have started a new frame
 }
 
 
@@ -628,11 +2006,10 @@ static void rp_print_routing_table(struct rp_conn *conn){
   printf("--------------------------------------------------\n");
   printf("Routing Table for node %02x:%02x\n",
          linkaddr_node_addr.u8[0], linkaddr_node_addr.u8[1]);
-  int ip = (int)conn->metric;
-  int fp = (int)((conn->metric - ip) * 100);
-  printf("Parent: %02x:%02x   |   Metric: %d.%02d\n",
+  printf("Parent: %02x:%02x   |   Backup: %02x:%02x   |   Metric: %u.%02u\n",
          conn->parent.u8[0], conn->parent.u8[1],
-         ip, fp);
+         conn->backup.u8[0], conn->backup.u8[1],
+         METRIC_Q124_INT(conn->metric), METRIC_Q124_FRAC(conn->metric));
   printf("--------------------------------------------------\n");
   printf("   Dest    |  Next Hop |   Type   |  Metric |  Age (ticks)\n");
   printf("--------------------------------------------------\n");
@@ -651,50 +2028,48 @@ static void rp_print_routing_table(struct rp_conn *conn){
       case 3: type_str = "NEIGHBOR";    break;
     }
 
-    float m = metric(metric_q124_to_float(e->adv_metric), e->etx);
-    int ip = (int)m;
-    int fp = (int)((m - ip) * 100);
-    printf(" %02x:%02x     | %02x:%02x     | %8s | %d.%02d | %10lu\n",
+    metric_q124_t m = nbr_path_metric(e);
+    printf(" %02x:%02x     | %02x:%02x     | %8s | %u.%02u | %10lu\n",
            dest->u8[0], dest->u8[1],
            e->nexthop.u8[0], e->nexthop.u8[1],
            type_str, 
-           ip, fp,
+           METRIC_Q124_INT(m), METRIC_Q124_FRAC(m),
            (clock_time() - e->age));
 
     e = nbr_table_next(nbr_tbl, e);
   }
 
+  uint16_t i;
+  for(i = 0; i < DSC_TBL_SIZE; i++){
+    const dsc_entry_t* d = dsc_tbl_get(i);
+    if(d == NULL) continue;
+    printf(" %02x:%02x     | %02x:%02x     | %8s |     -   |          -\n",
+           d->addr.u8[0], d->addr.u8[1],
+           d->nexthop.u8[0], d->nexthop.u8[1],
+           "DESCENDANT");
+  }
+
   printf("--------------------------------------------------\n\n");
 }
 
 
 
-static void print_topology_report(const linkaddr_t* child_addr) {
-  if(packetbuf_datalen() < sizeof(uint8_t)){
-      printf("rp: ERROR, packet too short (%d bytes)\n", packetbuf_datalen());
-      return;
-  }
-
-  uint8_t* dataptr = packetbuf_dataptr();
-  uint8_t report_size;
-  memcpy(&report_size, dataptr, sizeof(uint8_t));
-  dataptr += sizeof(uint8_t);
-
-  printf("\n[TOPOLOGY REPORT] Received from Child %02x:%02x\n", child_addr->u8[0], child_addr->u8[1]);
+#if !RP_NON_STORING
+static void print_topology_report(const linkaddr_t* child_addr, const tpl_vec_t* report) {
+  printf("\n[TOPOLOGY REPORT] Received from Child %02x:%02x (%d bytes)\n", child_addr->u8[0], child_addr->u8[1], packetbuf_datalen());
   printf("------------------------------------------\n");
   printf(" Node Address  | Status \n");
   printf("------------------------------------------\n");
 
   uint8_t i;
-  for(i = 0; i < report_size; i++) {
-      stat_addr_t entry;
-      memcpy(&entry, dataptr, sizeof(stat_addr_t));
-      dataptr += sizeof(stat_addr_t);
-
-      const char* status_str = (entry.status == STATUS_ADD) ? "Added" : "Removed";
-      printf(" %02x:%02x        | %s\n", entry.addr.u8[0], entry.addr.u8[1], status_str);
+  for(i = 0; i < report->size; i++) {
+      const stat_addr_t* entry = &report->stat_addr_arr[i];
+      const char* status_str = (entry->status == STATUS_ADD) ? "Added" : "Removed";
+      printf(" %02x:%02x        | %s\n", entry->addr.u8[0], entry->addr.u8[1], status_str);
   }
   printf("------------------------------------------\n\n");
 }
 
+#endif
+
 #endif /* USR_DEBUG */
\ No newline at end of file
@@ -0,0 +1,59 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+#include "short_id.h"
+#include <string.h>
+#if CONTIKI_TARGET_ZOUL
+#include "deployment.h"
+#endif
+/*---------------------------------------------------------------------------*/
+
+bool short_id_from_addr(const linkaddr_t* addr, uint8_t* id){
+#if CONTIKI_TARGET_ZOUL
+  uint16_t nid;
+  if(!deployment_get_id_by_addr(addr, &nid) || nid == SHORT_ID_NONE || nid > 0xFF) return false;
+  *id = (uint8_t)nid;
+  return true;
+#else
+  //Cooja: the address is the node ID, low byte first
+  if(addr->u8[1] != 0 || addr->u8[0] == SHORT_ID_NONE) return false;
+  *id = addr->u8[0];
+  return true;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+
+bool short_id_to_addr(uint8_t id, linkaddr_t* addr){
+  if(id == SHORT_ID_NONE) return false;
+#if CONTIKI_TARGET_ZOUL
+  return deployment_get_addr_by_id(id, addr);
+#else
+  addr->u8[0] = id;
+  addr->u8[1] = 0;
+  return true;
+#endif
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint8_t short_id_write(uint8_t* buf, const linkaddr_t* addr){
+  if(short_id_from_addr(addr, buf)) return 1;
+  buf[0] = SHORT_ID_NONE;
+  memcpy(buf + 1, addr, LINKADDR_SIZE);
+  return 1 + LINKADDR_SIZE;
+}
+
+/*---------------------------------------------------------------------------*/
+
+uint8_t short_id_read(const uint8_t* buf, uint16_t len, linkaddr_t* addr){
+  if(len < 1) return 0;
+  if(buf[0] != SHORT_ID_NONE)
+    return short_id_to_addr(buf[0], addr) ? 1 : 0;
+  if(len < 1 + LINKADDR_SIZE) return 0;
+  memcpy(addr, buf + 1, LINKADDR_SIZE);
+  return 1 + LINKADDR_SIZE;
+}
@@ -0,0 +1,161 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+#include "tpl_codec.h"
+#include "short_id.h"
+#include <string.h>
+/*---------------------------------------------------------------------------*/
+
+#define TPL_BM_MAX_LEN TPL_BM_LEN_MASK //31 bytes: up to 248 consecutive IDs
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------ENCODER-----------------------------------*/
+
+uint8_t tpl_encode(const stat_addr_t* arr, uint16_t n, uint8_t* buf, uint8_t max_len, uint8_t* n_enc){
+  uint8_t ids[TPL_VEC_CAP]; //short IDs of the entries to encode (SHORT_ID_NONE: none)
+  uint8_t avail = (n > TPL_VEC_CAP) ? TPL_VEC_CAP : (uint8_t)n;
+  uint8_t i;
+  for(i = 0; i < avail; i++){
+    linkaddr_t a = arr[i].addr; //aligned copy of the packed field
+    if(!short_id_from_addr(&a, &ids[i])) ids[i] = SHORT_ID_NONE;
+  }
+
+  /*id list: how many entries fit*/
+  uint8_t ls_n = 0, ls_len = 1;
+  uint8_t ids_len = 0;
+  while(ls_n < avail && ls_n < TPL_CNT_MASK){
+    uint8_t id_len = (ids[ls_n] == SHORT_ID_NONE) ? 1 + LINKADDR_SIZE : 1;
+    uint8_t len = 1 + (ls_n + 1 + 7) / 8 + ids_len + id_len;
+    if(len > max_len) break;
+    ids_len += id_len;
+    ls_len = len;
+    ls_n++;
+  }
+
+  /*bitmap: how many entries fit. Only entries with a short ID can be in the bitmap*/
+  uint8_t bm_n = 0, bm_len = 0, lo = 0xFF, hi = 0;
+  bool bm_rm = false;
+  while(bm_n < avail && ids[bm_n] != SHORT_ID_NONE){
+    uint8_t n_lo = (ids[bm_n] < lo) ? ids[bm_n] : lo;
+    uint8_t n_hi = (ids[bm_n] > hi) ? ids[bm_n] : hi;
+    uint8_t nb = ((n_hi - n_lo) >> 3) + 1;
+    bool rm = bm_rm || arr[bm_n].status == STATUS_REMOVE;
+    uint16_t len = 2 + (uint16_t)nb * (rm ? 2 : 1);
+    if(nb > TPL_BM_MAX_LEN || len > max_len) break;
+    lo = n_lo; hi = n_hi; bm_rm = rm;
+    bm_len = (uint8_t)len;
+    bm_n++;
+  }
+
+  if(bm_n > ls_n || (bm_n == ls_n && bm_n > 0 && bm_len < ls_len)){
+    uint8_t nb = ((hi - lo) >> 3) + 1;
+    uint8_t* add_bm = buf + 2;
+    uint8_t* rm_bm = buf + 2 + nb;
+    buf[0] = TPL_FMT_BITMAP | (bm_rm ? TPL_FMT_BM_REMOVE : 0) | nb;
+    buf[1] = lo;
+    memset(add_bm, 0, nb * (bm_rm ? 2 : 1));
+    for(i = 0; i < bm_n; i++){ //the last change of a node wins, as when the list is applied in order
+      uint8_t bit = ids[i] - lo;
+      uint8_t mask = 1 << (bit & 7);
+      if(arr[i].status == STATUS_ADD){
+        add_bm[bit >> 3] |= mask;
+        if(bm_rm) rm_bm[bit >> 3] &= ~mask;
+      }
+      else{
+        add_bm[bit >> 3] &= ~mask;
+        rm_bm[bit >> 3] |= mask;
+      }
+    }
+    *n_enc = bm_n;
+    return bm_len;
+  }
+
+  /*id list*/
+  uint8_t nst = (ls_n + 7) / 8;
+  uint8_t* p = buf + 1 + nst;
+  buf[0] = TPL_FMT_IDLIST | ls_n;
+  memset(buf + 1, 0, nst);
+  for(i = 0; i < ls_n; i++){
+    if(arr[i].status == STATUS_ADD) buf[1 + (i >> 3)] |= 1 << (i & 7);
+    *p++ = ids[i];
+    if(ids[i] == SHORT_ID_NONE){
+      memcpy(p, &arr[i].addr, LINKADDR_SIZE);
+      p += LINKADDR_SIZE;
+    }
+  }
+  *n_enc = ls_n;
+  return ls_len;
+}
+
+/*---------------------------------------------------------------------------*/
+/*---------------------------------DECODER-----------------------------------*/
+
+bool tpl_decode(const uint8_t* buf, uint16_t len, tpl_vec_t* out){
+  out->size = 0;
+  if(len < 1) return false;
+  uint8_t i;
+
+  switch(buf[0] & TPL_FMT_MASK){
+    case TPL_FMT_LEGACY:{
+      uint8_t cnt = buf[0] & TPL_CNT_MASK;
+      if(cnt > TPL_VEC_CAP || len < 1 + (uint16_t)cnt * sizeof(stat_addr_t)) return false;
+      for(i = 0; i < cnt; i++)
+        memcpy(&out->stat_addr_arr[i], buf + 1 + i * sizeof(stat_addr_t), sizeof(stat_addr_t));
+      out->size = cnt;
+      return true;
+    }
+
+    case TPL_FMT_IDLIST:{
+      uint8_t cnt = buf[0] & TPL_CNT_MASK;
+      uint8_t nst = (cnt + 7) / 8;
+      if(cnt > TPL_VEC_CAP || len < 1 + nst) return false;
+      const uint8_t* p = buf + 1 + nst;
+      const uint8_t* end = buf + len;
+      for(i = 0; i < cnt; i++){
+        stat_addr_t* sa = &out->stat_addr_arr[i];
+        if(p >= end) return false;
+        uint8_t id = *p++;
+        linkaddr_t a;
+        if(id == SHORT_ID_NONE){
+          if(end - p < LINKADDR_SIZE) return false;
+          memcpy(&a, p, LINKADDR_SIZE);
+          p += LINKADDR_SIZE;
+        }
+        else if(!short_id_to_addr(id, &a)) return false; //unknown ID
+        sa->addr = a;
+        sa->status = (buf[1 + (i >> 3)] & (1 << (i & 7))) ? STATUS_ADD : STATUS_REMOVE;
+      }
+      out->size = cnt;
+      return true;
+    }
+
+    case TPL_FMT_BITMAP:{
+      uint8_t nb = buf[0] & TPL_BM_LEN_MASK;
+      bool rm = buf[0] & TPL_FMT_BM_REMOVE;
+      if(nb == 0 || len < 2 + (uint16_t)nb * (rm ? 2 : 1)) return false;
+      uint8_t lo = buf[1];
+      const uint8_t* add_bm = buf + 2;
+      uint16_t bit;
+      for(bit = 0; bit < (uint16_t)nb * 8; bit++){
+        uint8_t mask = 1 << (bit & 7);
+        uint8_t status;
+        if(add_bm[bit >> 3] & mask) status = STATUS_ADD;
+        else if(rm && (add_bm[nb + (bit >> 3)] & mask)) status = STATUS_REMOVE;
+        else continue;
+        if(lo + bit > 0xFF || out->size >= TPL_VEC_CAP) return false;
+        linkaddr_t a;
+        if(!short_id_to_addr((uint8_t)(lo + bit), &a)) return false;
+        out->stat_addr_arr[out->size].addr = a;
+        out->stat_addr_arr[out->size].status = status;
+        out->size++;
+      }
+      return true;
+    }
+
+    default: //reserved format
+      return false;
+  }
+}
@@ -157,3 +157,15 @@ bool deployment_get_addr_by_id(uint16_t node_id, linkaddr_t* addr) {
   return false;
 }
 
+
+bool deployment_get_id_by_addr(const linkaddr_t* addr, uint16_t* node_id) {
+  for (uint16_t i=0; i<deployment_num_nodes; i++) {
+    // short addresses are the last two bytes of the IEEE address
+    if (deployment_id_addr_list[i].ieee_addr[6] == addr->u8[0] &&
+        deployment_id_addr_list[i].ieee_addr[7] == addr->u8[1]) {
+      *node_id = deployment_id_addr_list[i].id;
+      return true;
+    }
+  }
+  return false;
+}
@@ -30,4 +30,11 @@ void deployment_print_id_info(void);
  */
 bool deployment_get_addr_by_id(uint16_t node_id, linkaddr_t* addr);
 
+/* Get the node ID from its (short) address.
+ *
+ * If addr is found in the table, copies the ID to node_id and
+ * returns true. Otherwise returns false.
+ */
+bool deployment_get_id_by_addr(const linkaddr_t* addr, uint16_t* node_id);
+
 #endif /* DEPLOYMENT_H */
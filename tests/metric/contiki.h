@@ -0,0 +1 @@
+/* empty: the host build of the metric needs nothing from Contiki (see host_shim.h) */
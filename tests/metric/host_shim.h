@@ -0,0 +1,21 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+/* Host build of metric.h/metric.c: the few types of rp_types.h they use, without Contiki */
+#ifndef HOST_SHIM_H
+#define HOST_SHIM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define RP_TYPES /* rp_types.h is skipped */
+
+typedef uint16_t metric_q124_t;
+#define METRIC_Q124_INF  ((metric_q124_t)0xFFFFu)
+typedef uint16_t etx_q88_t;
+#define ETX_Q_FRAC_BITS      8
+
+#endif /* HOST_SHIM_H */
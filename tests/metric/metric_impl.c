@@ -0,0 +1,25 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+/* One build of the metric (METRIC_CONF_FIXED_POINT set by the Makefile) behind IMPL-prefixed
+   wrappers, so that the fixed point and the float builds can be linked in the same test */
+#include "metric.h"
+#include "../../src/metric.c"
+
+#define CAT_(a, b) a##_##b
+#define CAT(a, b) CAT_(a, b)
+
+etx_q88_t CAT(IMPL, etx_rssi)(int16_t rssi){
+  return etx_est_rssi(rssi);
+}
+
+metric_q124_t CAT(IMPL, metric)(metric_q124_t adv_metric, etx_q88_t etx){
+  return metric(adv_metric, etx);
+}
+
+bool CAT(IMPL, preferred)(metric_q124_t new_m, metric_q124_t cur_m){
+  return preferred(new_m, cur_m);
+}
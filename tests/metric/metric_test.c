@@ -0,0 +1,107 @@
+/*
+ *
+ * Student Name: Damiano Salvaterra
+ *
+ */
+
+/* Host equivalence test of the fixed point metric (METRIC_CONF_FIXED_POINT 1) against the
+   float one (0): RSSI prior, path metric and parent preference, plus the time per call.
+   Run with make check (see the Makefile) */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+etx_q88_t fx_etx_rssi(int16_t rssi);
+etx_q88_t fl_etx_rssi(int16_t rssi);
+metric_q124_t fx_metric(metric_q124_t adv_metric, etx_q88_t etx);
+metric_q124_t fl_metric(metric_q124_t adv_metric, etx_q88_t etx);
+bool fx_preferred(metric_q124_t new_m, metric_q124_t cur_m);
+bool fl_preferred(metric_q124_t new_m, metric_q124_t cur_m);
+
+/* same constants as metric.h */
+#define THR_H         100.0
+#define DELTA_ETX_MIN 0.30
+
+static unsigned failures;
+
+#define CHECK(cond, ...) do{ if(!(cond)){ failures++; if(failures <= 10) printf("FAIL: " __VA_ARGS__); } }while(0)
+
+/*---------------------------------------------------------------------------*/
+/* both round to the nearest Q8.8: at most one LSB apart */
+static void test_etx_est_rssi(void){
+  int rssi;
+  for(rssi = -128; rssi <= 20; rssi++){
+    int fx = fx_etx_rssi(rssi), fl = fl_etx_rssi(rssi);
+    CHECK(abs(fx - fl) <= 1, "etx_est_rssi(%d): fixed %d float %d\n", rssi, fx, fl);
+  }
+}
+
+/*---------------------------------------------------------------------------*/
+/* the fixed point rounds the ETX to Q12.4 before the sum, the float rounds the sum: one LSB at most.
+   Infinity is absorbing in both */
+static void test_metric(void){
+  uint32_t adv, etx;
+  for(adv = 0; adv <= 0xFFFF; adv += (adv < 4096) ? 1 : 61){
+    for(etx = 256; etx <= 0xFFFF; etx += 7){
+      int fx = fx_metric(adv, etx), fl = fl_metric(adv, etx);
+      CHECK(abs(fx - fl) <= 1, "metric(%u, %u): fixed %d float %d\n", adv, etx, fx, fl);
+    }
+    CHECK(fx_metric(adv, 0xFFFF) >= fx_metric(adv, 256), "metric(%u, .) not monotonic\n", adv);
+  }
+  CHECK(fx_metric(METRIC_Q124_INF, 256) == METRIC_Q124_INF, "fixed: infinity not absorbing\n");
+  CHECK(fl_metric(METRIC_Q124_INF, 256) == METRIC_Q124_INF, "float: infinity not absorbing\n");
+}
+
+/*---------------------------------------------------------------------------*/
+/* the two may only disagree when the improvement is within the threshold rounding (Q12.12) */
+static void test_preferred(void){
+  uint32_t cur, new_m;
+  unsigned disagree = 0, total = 0;
+  for(cur = 1; cur < 0xFFFF; cur += (cur < 1024) ? 1 : 37){
+    for(new_m = 0; new_m <= cur + 16 && new_m < 0xFFFF; new_m += (new_m + 64 < cur) ? 13 : 1){
+      total++;
+      if(fx_preferred(new_m, cur) == fl_preferred(new_m, cur)) continue;
+      disagree++;
+      double cur_f = cur / 16.0, thr = THR_H / cur_f;
+      if(thr < DELTA_ETX_MIN) thr = DELTA_ETX_MIN;
+      double margin = (cur_f - new_m / 16.0) - thr;
+      CHECK(margin > -1.0 / 256 && margin < 1.0 / 256, "preferred(%u, %u): disagreement %.5f from the threshold\n",
+            new_m, cur, margin);
+    }
+  }
+  printf("preferred: %u cases, %u disagreements at the threshold boundary\n", total, disagree);
+}
+
+/*---------------------------------------------------------------------------*/
+/* ns per beacon: prior, path metric and preference, as in bc_recv() */
+static double bench(metric_q124_t (*m)(metric_q124_t, etx_q88_t), bool (*p)(metric_q124_t, metric_q124_t),
+                    etx_q88_t (*e)(int16_t)){
+  struct timespec t0, t1;
+  volatile unsigned sink = 0;
+  uint32_t i;
+  const uint32_t n = 20000000;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for(i = 0; i < n; i++){
+    etx_q88_t etx = e(-40 - (int16_t)(i & 63));
+    metric_q124_t mt = m((metric_q124_t)(i & 0x3FFF), etx);
+    sink += p(mt, (metric_q124_t)((i * 7) & 0x3FFF));
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  (void)sink;
+  return ((t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec)) / n;
+}
+
+/*---------------------------------------------------------------------------*/
+int main(void){
+  test_etx_est_rssi();
+  test_metric();
+  test_preferred();
+  printf("host time per beacon: fixed %.2f ns, float %.2f ns\n",
+         bench(fx_metric, fx_preferred, fx_etx_rssi), bench(fl_metric, fl_preferred, fl_etx_rssi));
+  if(failures){
+    printf("%u checks FAILED\n", failures);
+    return 1;
+  }
+  printf("fixed point and float metric are equivalent\n");
+  return 0;
+}
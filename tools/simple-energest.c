@@ -99,6 +99,17 @@ simple_energest_step(void)
   	delta_rx);
 }
 /*---------------------------------------------------------------------------*/
+uint16_t
+simple_energest_radio_dc(void)
+{
+  uint32_t total = delta_cpu + delta_lpm;
+  if(total == 0) {
+    return 0;
+  }
+  /* 15 s steps: the product fits in 32 bits */
+  return (uint16_t)(((delta_tx + delta_rx) * 1000) / total);
+}
+/*---------------------------------------------------------------------------*/
 PROCESS_THREAD(energest_process, ev, data)
 {
   static struct etimer periodic;
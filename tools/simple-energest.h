@@ -40,5 +40,7 @@
 /*---------------------------------------------------------------------------*/
 void simple_energest_start(void);
 void simple_energest_step(void);
+/* radio duty cycle (listen + transmit) of the last step, in permille */
+uint16_t simple_energest_radio_dc(void);
 /*---------------------------------------------------------------------------*/
 #endif /* SIMPLE_ENERGEST_H */